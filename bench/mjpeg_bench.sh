@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# End-to-end MJPEG throughput benchmark: builds the server and load generator,
+# starts the server on synthetic cameras and drives it with concurrent viewers.
+# Writes a JSON report (load generator results plus run parameters) suitable
+# for tracking regressions between commits.
+#
+#   CAMERAS=8 CLIENTS=200 DURATION=30 bench/mjpeg_bench.sh [report.json]
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+WORK="$(mktemp -d)"
+REPORT="${1:-mjpeg_bench.json}"
+
+CAMERAS="${CAMERAS:-4}"
+CLIENTS="${CLIENTS:-50}"
+DURATION="${DURATION:-20}"
+CAMERA_FPS="${CAMERA_FPS:-25}"
+CAMERA_URL="${CAMERA_URL:-synthetic://?width=1280&height=720&fps=${CAMERA_FPS}&pattern=bars&motion=box}"
+LOADGEN_THREADS="${LOADGEN_THREADS:-2}"
+
+cleanup() {
+  [[ -n "${SERVER_PID:-}" ]] && kill "$SERVER_PID" 2>/dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+echo "Building server and load generator..."
+cmake -S "$ROOT" -B "$WORK/build" -DCMAKE_BUILD_TYPE=Release -DRTSP_BUILD_BENCHMARKS=OFF >/dev/null
+cmake --build "$WORK/build" -j"$(nproc)" --target server mjpeg_loadgen >/dev/null
+cp "$WORK/build/server" "$WORK/build/mjpeg_loadgen" "$WORK/"
+
+echo "Starting server with $CAMERAS synthetic cameras..."
+(cd "$WORK" && CAMERA_STORE_PATH="$WORK/cameras.json" exec ./server >"$WORK/server.log" 2>&1) &
+SERVER_PID=$!
+
+for _ in $(seq 50); do
+  curl -s -o /dev/null localhost:3001/ && break
+  sleep 0.1
+done
+
+PATHS=""
+for _ in $(seq "$CAMERAS"); do
+  reply="$(curl -sf -X POST localhost:3001/cameras -d "{\"url\": \"$CAMERA_URL\", \"frameRate\": $CAMERA_FPS}")"
+  PATHS="${PATHS:+$PATHS,}/${reply##* }"
+done
+
+echo "Running $CLIENTS clients for ${DURATION}s against $PATHS..."
+"$WORK/mjpeg_loadgen" --clients "$CLIENTS" --paths "$PATHS" --duration "$DURATION" \
+  --threads "$LOADGEN_THREADS" --json "$WORK/loadgen.json" || true
+
+{
+  echo "{"
+  echo "  \"commit\": \"$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)\","
+  echo "  \"timestamp\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+  echo "  \"cameras\": $CAMERAS,"
+  echo "  \"cameraUrl\": \"$CAMERA_URL\","
+  echo "  \"cpus\": $(nproc),"
+  echo "  \"loadgen\": $(cat "$WORK/loadgen.json")"
+  echo "}"
+} >"$REPORT"
+
+echo "Report written to $REPORT"
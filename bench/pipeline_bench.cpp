@@ -0,0 +1,189 @@
+// Micro-benchmarks of the individual stages a frame goes through between
+// capture and the viewer's socket, so each optimization can be measured in
+// isolation on the target hardware:
+//
+//   ./build/pipeline_bench --benchmark_filter=Imencode
+//
+// Frames come from the synthetic camera source, which compresses like a real
+// scene (flat areas, edges, text) rather than like random noise.
+// BM_TurboJpeg compares against libjpeg-turbo's own API when the build finds
+// libturbojpeg (HAVE_TURBOJPEG).
+
+#include <benchmark/benchmark.h>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include "multipart.h"
+#include "virtual_sources.h"
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace
+{
+  Mat syntheticFrame(int width, int height)
+  {
+    SyntheticCapture source("synthetic://?width=" + to_string(width) + "&height=" + to_string(height) +
+                            "&pattern=bars&motion=box");
+    Mat frame;
+    source.read(frame);
+    return frame;
+  }
+
+  void resolutions(benchmark::internal::Benchmark *bench)
+  {
+    bench->Args({640, 360})->Args({1280, 720})->Args({1920, 1080})->Args({3840, 2160});
+  }
+
+  void setFrameCounters(benchmark::State &state, const Mat &frame)
+  {
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * frame.total() * frame.elemSize());
+  }
+}
+
+// Capture publishes frames by reference; this is the cost it avoids per frame.
+static void BM_CopyTo(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(state.range(0), state.range(1));
+  Mat copy;
+  for (auto _ : state)
+  {
+    frame.copyTo(copy);
+    benchmark::DoNotOptimize(copy.data);
+  }
+  setFrameCounters(state, frame);
+}
+BENCHMARK(BM_CopyTo)->Apply(resolutions);
+
+static void BM_BgrToYuvI420(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(state.range(0), state.range(1));
+  Mat yuv;
+  for (auto _ : state)
+  {
+    cvtColor(frame, yuv, COLOR_BGR2YUV_I420);
+    benchmark::DoNotOptimize(yuv.data);
+  }
+  setFrameCounters(state, frame);
+}
+BENCHMARK(BM_BgrToYuvI420)->Apply(resolutions);
+
+static void BM_YuvI420ToBgr(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(state.range(0), state.range(1));
+  Mat yuv, bgr;
+  cvtColor(frame, yuv, COLOR_BGR2YUV_I420);
+  for (auto _ : state)
+  {
+    cvtColor(yuv, bgr, COLOR_YUV2BGR_I420);
+    benchmark::DoNotOptimize(bgr.data);
+  }
+  setFrameCounters(state, frame);
+}
+BENCHMARK(BM_YuvI420ToBgr)->Apply(resolutions);
+
+static void BM_BgrToGray(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(state.range(0), state.range(1));
+  Mat gray;
+  for (auto _ : state)
+  {
+    cvtColor(frame, gray, COLOR_BGR2GRAY);
+    benchmark::DoNotOptimize(gray.data);
+  }
+  setFrameCounters(state, frame);
+}
+BENCHMARK(BM_BgrToGray)->Apply(resolutions);
+
+// 1080p down to a 360p rendition with each interpolation mode.
+static void BM_Resize(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(1920, 1080);
+  Mat small;
+  int interpolation = state.range(0);
+  for (auto _ : state)
+  {
+    resize(frame, small, Size(640, 360), 0, 0, interpolation);
+    benchmark::DoNotOptimize(small.data);
+  }
+  setFrameCounters(state, frame);
+}
+BENCHMARK(BM_Resize)->Arg(INTER_NEAREST)->Arg(INTER_LINEAR)->Arg(INTER_AREA)->Arg(INTER_CUBIC);
+
+static void BM_Imencode(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(state.range(0), state.range(1));
+  vector<int> params = {IMWRITE_JPEG_QUALITY, (int)state.range(2)};
+  vector<uchar> jpeg;
+  for (auto _ : state)
+  {
+    imencode(".jpg", frame, jpeg, params);
+    benchmark::DoNotOptimize(jpeg.data());
+  }
+  setFrameCounters(state, frame);
+  state.counters["jpegBytes"] = jpeg.size();
+}
+BENCHMARK(BM_Imencode)->ArgsProduct({{1280}, {720}, {50, 75, 90}})->Args({1920, 1080, 90});
+
+#ifdef HAVE_TURBOJPEG
+static void BM_TurboJpeg(benchmark::State &state)
+{
+  Mat frame = syntheticFrame(state.range(0), state.range(1));
+  tjhandle compressor = tjInitCompress();
+  unsigned char *jpeg = nullptr;
+  unsigned long jpegSize = 0;
+  int flags = state.range(3) ? TJFLAG_FASTDCT : 0;
+  for (auto _ : state)
+  {
+    // Reuses the output buffer like the encoder's frame pool does.
+    tjCompress2(compressor, frame.data, frame.cols, frame.step, frame.rows, TJPF_BGR, &jpeg, &jpegSize,
+                TJSAMP_420, (int)state.range(2), flags);
+    benchmark::DoNotOptimize(jpeg);
+  }
+  setFrameCounters(state, frame);
+  state.counters["jpegBytes"] = jpegSize;
+  tjFree(jpeg);
+  tjDestroy(compressor);
+}
+BENCHMARK(BM_TurboJpeg)->ArgsProduct({{1280}, {720}, {50, 75, 90}, {0, 1}})->Args({1920, 1080, 90, 1});
+#endif
+
+static void BM_FramePartHeaders(benchmark::State &state)
+{
+  FrameInfo info;
+  info.seq = 123456;
+  info.captureTimeUs = 1760000000123456;
+  for (auto _ : state)
+  {
+    string headers = framePartHeaders(85000, &info);
+    benchmark::DoNotOptimize(headers.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FramePartHeaders);
+
+// Copying headers and JPEG into one buffer, the alternative to the gather
+// write the stream server does.
+static void BM_FramePartCopy(benchmark::State &state)
+{
+  FrameInfo info;
+  vector<uchar> jpeg(state.range(0), 0x55);
+  string part;
+  for (auto _ : state)
+  {
+    string headers = framePartHeaders(jpeg.size(), &info);
+    part.assign(headers);
+    part.append((const char *)jpeg.data(), jpeg.size());
+    part.append("\r\n");
+    benchmark::DoNotOptimize(part.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * jpeg.size());
+}
+BENCHMARK(BM_FramePartCopy)->Arg(30000)->Arg(120000)->Arg(400000);
+
+BENCHMARK_MAIN();
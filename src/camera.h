@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "latency_histogram.h"
+#include "sharded_counter.h"
+
+enum class CameraHealth
+{
+  Connecting,
+  Live,
+  Backoff,
+  Failed
+};
+
+inline const char *healthName(CameraHealth health)
+{
+  switch (health)
+  {
+  case CameraHealth::Connecting:
+    return "connecting";
+  case CameraHealth::Live:
+    return "live";
+  case CameraHealth::Backoff:
+    return "backoff";
+  case CameraHealth::Failed:
+    return "failed";
+  }
+  return "unknown";
+}
+
+// Identity of a captured frame, carried through encoding to every viewer.
+struct FrameInfo
+{
+  uint64_t seq = 0;
+  // Wall-clock capture time, in microseconds since the Unix epoch.
+  int64_t captureTimeUs = 0;
+  std::chrono::steady_clock::time_point capturedAt;
+};
+
+// A frame encoded once and shared, read-only, by every viewer of the camera.
+struct EncodedFrame
+{
+  FrameInfo info;
+  std::chrono::steady_clock::time_point encodedAt;
+  // Decodes without any earlier frame; always true for JPEG.
+  bool keyframe = true;
+  // Position among the frames published for its stream (the default JPEG or
+  // one rendition), from 1. Unlike info.seq it has no gaps for frames that
+  // were never encoded, so a viewer's gaps in it are frames it skipped.
+  uint64_t publishedSeq = 0;
+  std::vector<uchar> jpeg;
+};
+
+// Encoding parameters viewers can ask for; 0 keeps the source size or the
+// encoder's quality. A missing width or height follows the aspect ratio.
+// Frame rate is not part of it: every rendition is encoded at the camera's
+// rate and slower viewers pick frames from it (see FrameRateLimiter).
+struct RenditionKey
+{
+  int width = 0;
+  int height = 0;
+  int quality = 0;
+
+  bool isDefault() const { return !width && !height && !quality; }
+  bool operator<(const RenditionKey &other) const
+  {
+    return std::tie(width, height, quality) < std::tie(other.width, other.height, other.quality);
+  }
+};
+
+// A scaled or re-encoded variant of a camera's stream, encoded once per
+// frame for all the viewers that asked for the same parameters.
+struct Rendition
+{
+  RenditionKey key;
+  // Guarded by the camera's frameMutex; notified through frameAvailable.
+  int subscribers = 0;
+  std::shared_ptr<const EncodedFrame> current;
+};
+
+struct CameraLatency
+{
+  // Time spent in VideoCapture::read (demux + decode, plus any wait for data).
+  LatencyHistogram decode;
+  LatencyHistogram captureToEncode;
+  LatencyHistogram encode;
+  LatencyHistogram captureToSend;
+};
+
+struct CameraMetrics
+{
+  ShardedCounter framesCaptured;
+  ShardedCounter emptyReads;
+  ShardedCounter reconnects;
+  ShardedCounter framesEncoded;
+  // Frames encoded for renditions other than the default one.
+  ShardedCounter renditionFramesEncoded;
+  // Captured frames the encoder never saw because a newer one replaced them.
+  ShardedCounter encodeDropped;
+  ShardedCounter framesSent;
+  // Encoded frames a viewer skipped because it was still sending an older
+  // one; frames the encoder never saw are in encodeDropped, not here.
+  ShardedCounter sendDropped;
+  ShardedCounter bytesSent;
+  ShardedCounter framesRecorded;
+  ShardedCounter bytesRecorded;
+  // Encoded frames not recorded because the disk writer fell behind.
+  ShardedCounter recordDropped;
+  ShardedCounter thumbnailsWritten;
+  // Thumbnails skipped because the thumbnail writer fell behind.
+  ShardedCounter thumbnailDropped;
+  ShardedCounter motionAnalysed;
+  // Frames due for motion analysis that a newer one replaced while queued.
+  ShardedCounter motionDropped;
+  ShardedCounter motionEvents;
+  // Thread CPU time spent on motion analysis.
+  ShardedCounter motionCpuUs;
+  std::atomic<float> motionScore{0};
+  std::atomic<int> viewers{0};
+  // Memory held by the pre-event buffer.
+  std::atomic<size_t> preEventBytes{0};
+  std::atomic<size_t> preEventFrames{0};
+  // Exponentially smoothed rate of captured frames.
+  std::atomic<float> captureFps{0};
+};
+
+struct CameraConfig
+{
+  int id = 0;
+  std::string url;
+  int frameRate;
+  // Continuously record the encoded stream to disk.
+  bool record = false;
+  // Seconds of encoded frames kept in memory for event clips; 0 disables.
+  int preEventSeconds = 0;
+  // Frames per second analysed for motion; 0 disables. Can change while
+  // the camera runs.
+  std::atomic<int> motionFps{0};
+  std::atomic<bool> active{false};
+  std::atomic<CameraHealth> health{CameraHealth::Connecting};
+  // Guarded by frameMutex.
+  cv::Mat currentFrame;
+  FrameInfo currentFrameInfo;
+  std::shared_ptr<const EncodedFrame> currentJpeg;
+  std::map<RenditionKey, std::shared_ptr<Rendition>> renditions;
+  std::mutex frameMutex;
+  std::condition_variable frameAvailable;
+  // Frames are only JPEG-encoded while someone is subscribed.
+  std::atomic<int> jpegSubscribers{0};
+  std::atomic<int> renditionSubscribers{0};
+  std::atomic<bool> encodeQueued{false};
+  CameraLatency latency;
+  CameraMetrics metrics;
+};
@@ -0,0 +1,111 @@
+#include "camera_store.h"
+
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include "./include/crow_all.h"
+
+using namespace std;
+
+CameraStore::CameraStore(string path) : path(move(path)) {}
+
+CameraRegistrySnapshot CameraStore::load() const
+{
+  CameraRegistrySnapshot snapshot;
+
+  ifstream in(path);
+  if (!in)
+  {
+    return snapshot;
+  }
+
+  stringstream contents;
+  contents << in.rdbuf();
+
+  auto json = crow::json::load(contents.str());
+  if (!json)
+  {
+    throw runtime_error("Corrupt camera store: " + path);
+  }
+
+  if (json.has("nextCameraId"))
+  {
+    snapshot.nextCameraId = json["nextCameraId"].i();
+  }
+  if (json.has("cameras"))
+  {
+    for (auto &entry : json["cameras"])
+    {
+      StoredCamera camera{(int)entry["id"].i(), entry["url"].s(), (int)entry["frameRate"].i()};
+      camera.record = entry.has("record") && entry["record"].b();
+      camera.preEventSeconds = entry.has("preEventSeconds") ? (int)entry["preEventSeconds"].i() : 0;
+      camera.motionFps = entry.has("motionFps") ? (int)entry["motionFps"].i() : 0;
+      snapshot.cameras.push_back(camera);
+      snapshot.nextCameraId = max(snapshot.nextCameraId, camera.id + 1);
+    }
+  }
+  return snapshot;
+}
+
+void CameraStore::save(const CameraRegistrySnapshot &snapshot)
+{
+  crow::json::wvalue json;
+  json["version"] = 1;
+  json["nextCameraId"] = snapshot.nextCameraId;
+
+  vector<crow::json::wvalue> cameras;
+  for (auto &camera : snapshot.cameras)
+  {
+    crow::json::wvalue entry;
+    entry["id"] = camera.id;
+    entry["url"] = camera.url;
+    entry["frameRate"] = camera.frameRate;
+    entry["record"] = camera.record;
+    entry["preEventSeconds"] = camera.preEventSeconds;
+    entry["motionFps"] = camera.motionFps;
+    cameras.push_back(move(entry));
+  }
+  json["cameras"] = move(cameras);
+
+  string body = json.dump();
+  string tmpPath = path + ".tmp";
+
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    throw runtime_error("Failed to write camera store: " + tmpPath);
+  }
+
+  size_t written = 0;
+  while (written < body.size())
+  {
+    ssize_t n = ::write(fd, body.data() + written, body.size() - written);
+    if (n < 0)
+    {
+      ::close(fd);
+      throw runtime_error("Failed to write camera store: " + tmpPath);
+    }
+    written += n;
+  }
+  ::fsync(fd);
+  ::close(fd);
+
+  if (::rename(tmpPath.c_str(), path.c_str()) != 0)
+  {
+    throw runtime_error("Failed to replace camera store: " + path);
+  }
+}
+
+string CameraStore::setAside()
+{
+  string corruptPath = path + ".corrupt-" + to_string((long long)time(nullptr));
+  if (::rename(path.c_str(), corruptPath.c_str()) != 0)
+  {
+    return "";
+  }
+  return corruptPath;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct StoredCamera
+{
+  int id;
+  std::string url;
+  int frameRate;
+  bool record = false;
+  int preEventSeconds = 0;
+  int motionFps = 0;
+};
+
+struct CameraRegistrySnapshot
+{
+  int nextCameraId = 1;
+  std::vector<StoredCamera> cameras;
+};
+
+// Persists the camera registry as a small JSON document so a restarted
+// service can bring every camera back without clients re-POSTing them.
+// Writes go to a temporary file that is renamed over the old one, so a crash
+// mid-save never leaves a truncated registry behind. Callers serialize saves.
+class CameraStore
+{
+private:
+  std::string path;
+
+public:
+  explicit CameraStore(std::string path);
+
+  const std::string &getPath() const { return path; }
+
+  // Returns an empty snapshot when the file does not exist yet; throws
+  // std::runtime_error when it exists but cannot be parsed.
+  CameraRegistrySnapshot load() const;
+  void save(const CameraRegistrySnapshot &snapshot);
+  // Renames an unreadable store to <path>.corrupt-<unix seconds> so nothing
+  // overwrites it; returns the new path, or an empty string on failure.
+  std::string setAside();
+};
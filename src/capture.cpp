@@ -0,0 +1,305 @@
+#include "capture.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include "logger.h"
+#include "thread_tuning.h"
+#include "trace.h"
+#include "virtual_sources.h"
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  // A source that returns nothing for this long is treated as lost and
+  // reopened; reads that merely hiccup are retried on the open stream.
+  constexpr auto streamLossTimeout = seconds(5);
+  constexpr auto initialBackoff = milliseconds(500);
+  constexpr auto maxBackoff = seconds(30);
+  // After this many failed reopen attempts in a row the camera is reported
+  // as failed; it keeps being probed at maxBackoff so it recovers on its own.
+  constexpr int failedAfterAttempts = 8;
+
+  milliseconds backoffDelay(int attempt)
+  {
+    auto delay = initialBackoff * (1 << min(attempt, 16));
+    if (delay > maxBackoff)
+    {
+      delay = duration_cast<milliseconds>(maxBackoff);
+    }
+    // +/-20% jitter so cameras behind one switch don't reconnect in lockstep.
+    return milliseconds(delay.count() * (80 + rand() % 41) / 100);
+  }
+}
+
+CaptureSession::CaptureSession(int cameraId, shared_ptr<CameraConfig> config, unique_ptr<VideoCapture> cap,
+                               JpegEncoderPool *encoder, vector<CapturedFrameListener *> listeners,
+                               function<void(bool)> onFirstResult)
+    : cameraId(cameraId), config(move(config)), cap(move(cap)), encoder(encoder), listeners(move(listeners)),
+      onFirstResult(move(onFirstResult)), lastFrameAt(Clock::now()), nextFrameDue(Clock::now())
+{
+}
+
+unique_ptr<VideoCapture> CaptureSession::openCapture(const string &url)
+{
+  if (auto source = openVirtualSource(url))
+  {
+    return source;
+  }
+
+  // Bound FFmpeg's open/read so a dead camera surfaces as a failed read
+  // instead of blocking the capture thread for its default 30s timeout.
+  vector<int> params = {CAP_PROP_OPEN_TIMEOUT_MSEC, 10000, CAP_PROP_READ_TIMEOUT_MSEC, 5000};
+  return make_unique<VideoCapture>(url, CAP_ANY, params);
+}
+
+void CaptureSession::reportFirstResult(bool live)
+{
+  if (onFirstResult)
+  {
+    onFirstResult(live);
+    onFirstResult = nullptr;
+  }
+}
+
+void CaptureSession::setHealth(CameraHealth health)
+{
+  CameraHealth previous;
+  {
+    lock_guard<mutex> lock(config->frameMutex);
+    previous = config->health.exchange(health);
+  }
+  if (previous != health)
+  {
+    LOG_INFO("Camera %d is %s", cameraId, healthName(health));
+    config->frameAvailable.notify_all();
+  }
+}
+
+CaptureSession::Clock::time_point CaptureSession::open()
+{
+  {
+    TraceSpan span("open", cameraId);
+    cap = openCapture(config->url);
+  }
+  auto now = Clock::now();
+
+  if (!cap->isOpened())
+  {
+    reportFirstResult(false);
+    failedAttempts++;
+    setHealth(failedAttempts >= failedAfterAttempts ? CameraHealth::Failed : CameraHealth::Backoff);
+    return now + backoffDelay(failedAttempts - 1);
+  }
+
+  lastFrameAt = now;
+  nextFrameDue = now;
+  return now;
+}
+
+CaptureSession::Clock::time_point CaptureSession::readFrame()
+{
+  auto readStarted = Clock::now();
+  Mat frame;
+  {
+    TraceSpan span("read", cameraId);
+    cap->read(frame);
+  }
+  auto now = Clock::now();
+
+  if (frame.empty())
+  {
+    config->metrics.emptyReads.add();
+    LOG_RATE_LIMITED(LogLevel::Debug, 1, "Empty read from camera %d", cameraId);
+    if (now - lastFrameAt > streamLossTimeout)
+    {
+      LOG_ERROR("Lost stream from camera %d, reconnecting", cameraId);
+      config->metrics.reconnects.add();
+      cap.reset();
+      setHealth(CameraHealth::Backoff);
+      return now + backoffDelay(failedAttempts);
+    }
+    // Avoid spinning on a source that returns empty reads immediately.
+    return now + milliseconds(10);
+  }
+
+  config->latency.decode.record(now - readStarted);
+  config->metrics.framesCaptured.add();
+  if (frameSeq > 0)
+  {
+    float instantFps = 1.0f / max(1e-6f, duration<float>(now - lastFrameAt).count());
+    float smoothed = config->metrics.captureFps;
+    config->metrics.captureFps = smoothed == 0 ? instantFps : smoothed * 0.9f + instantFps * 0.1f;
+  }
+
+  failedAttempts = 0;
+  lastFrameAt = now;
+
+  FrameInfo info;
+  info.seq = ++frameSeq;
+  info.captureTimeUs = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  info.capturedAt = now;
+
+  TraceSpan publishSpan("publish", cameraId);
+  {
+    lock_guard<mutex> lock(config->frameMutex);
+    // `frame` is freshly allocated by every read, so publishing it by
+    // reference is safe and saves a full-frame copy.
+    config->currentFrame = frame;
+    config->currentFrameInfo = info;
+  }
+  setHealth(CameraHealth::Live);
+  config->frameAvailable.notify_all();
+  if (encoder && (config->jpegSubscribers > 0 || config->renditionSubscribers > 0))
+  {
+    encoder->frameReady(config);
+  }
+  for (CapturedFrameListener *listener : listeners)
+  {
+    listener->frameCaptured(*config, frame, info);
+  }
+  reportFirstResult(true);
+
+  // Pace against the schedule rather than the end of this read so the
+  // configured rate holds even when reads take a variable amount of time.
+  nextFrameDue += milliseconds(1000 / max(1, config->frameRate));
+  if (nextFrameDue < now)
+  {
+    nextFrameDue = now;
+  }
+  return nextFrameDue;
+}
+
+void CaptureSession::run()
+{
+  applyThreadTuning(ThreadRole::Capture);
+  setTraceThreadName("capture-" + to_string(cameraId));
+  while (isActive())
+  {
+    auto due = needsOpen() ? open() : readFrame();
+    if (due > Clock::now())
+    {
+      // Wakes early when the camera is removed.
+      unique_lock<mutex> lock(config->frameMutex);
+      config->frameAvailable.wait_until(lock, due, [&]
+                                        { return !config->active; });
+    }
+  }
+}
+
+CaptureWorkerPool::CaptureWorkerPool(size_t workerCount, size_t connectorCount)
+{
+  for (size_t i = 0; i < workerCount; i++)
+  {
+    workers.emplace_back(&CaptureWorkerPool::workerLoop, this);
+  }
+  for (size_t i = 0; i < max<size_t>(connectorCount, 1); i++)
+  {
+    connectors.emplace_back(&CaptureWorkerPool::connectLoop, this);
+  }
+}
+
+CaptureWorkerPool::~CaptureWorkerPool()
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+  }
+  readyChanged.notify_all();
+  connectAvailable.notify_all();
+
+  for (auto &worker : workers)
+  {
+    worker.join();
+  }
+  for (auto &connector : connectors)
+  {
+    connector.join();
+  }
+}
+
+void CaptureWorkerPool::submit(shared_ptr<CaptureSession> session, CaptureSession::Clock::time_point startAt)
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    ready.push({startAt, move(session)});
+  }
+  readyChanged.notify_one();
+}
+
+void CaptureWorkerPool::workerLoop()
+{
+  applyThreadTuning(ThreadRole::Capture);
+  setTraceThreadName("capture-pool");
+  unique_lock<mutex> lock(queueMutex);
+  while (!stopping)
+  {
+    if (ready.empty())
+    {
+      readyChanged.wait(lock);
+      continue;
+    }
+
+    auto due = ready.top().due;
+    if (CaptureSession::Clock::now() < due)
+    {
+      readyChanged.wait_until(lock, due);
+      continue;
+    }
+
+    auto session = ready.top().session;
+    ready.pop();
+
+    if (!session->isActive())
+    {
+      continue;
+    }
+
+    if (session->needsOpen())
+    {
+      connecting.push_back(move(session));
+      connectAvailable.notify_one();
+      continue;
+    }
+
+    // Another worker may be sleeping until a later deadline; let it pick up
+    // whatever became due while this one is busy reading.
+    if (!ready.empty())
+    {
+      readyChanged.notify_one();
+    }
+
+    lock.unlock();
+    auto next = session->readFrame();
+    lock.lock();
+
+    ready.push({next, move(session)});
+  }
+}
+
+void CaptureWorkerPool::connectLoop()
+{
+  applyThreadTuning(ThreadRole::Capture);
+  setTraceThreadName("capture-connect");
+  unique_lock<mutex> lock(queueMutex);
+  while (!stopping)
+  {
+    if (connecting.empty())
+    {
+      connectAvailable.wait(lock);
+      continue;
+    }
+
+    auto session = move(connecting.front());
+    connecting.pop_front();
+
+    lock.unlock();
+    auto next = session->open();
+    lock.lock();
+
+    ready.push({next, move(session)});
+    readyChanged.notify_one();
+  }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "encoder.h"
+
+// Receives every decoded frame on the capture thread, right after it is
+// published. Implementations must return quickly: anything slow belongs on
+// their own thread. `frame` is never written to again, so it may be kept by
+// reference.
+class CapturedFrameListener
+{
+public:
+  virtual ~CapturedFrameListener() = default;
+  virtual void frameCaptured(CameraConfig &camera, const cv::Mat &frame, const FrameInfo &info) = 0;
+};
+
+// Capture state machine for one camera. Each call to open() or readFrame()
+// does a single bounded unit of work and returns the time the session wants
+// to run next, so the same session can be driven either by its own thread
+// (run()) or by a CaptureWorkerPool shared with many other cameras.
+class CaptureSession
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+private:
+  int cameraId;
+  std::shared_ptr<CameraConfig> config;
+  std::unique_ptr<cv::VideoCapture> cap;
+  JpegEncoderPool *encoder;
+  std::vector<CapturedFrameListener *> listeners;
+  std::function<void(bool)> onFirstResult;
+  uint64_t frameSeq = 0;
+  int failedAttempts = 0;
+  Clock::time_point lastFrameAt;
+  Clock::time_point nextFrameDue;
+
+  void reportFirstResult(bool live);
+  void setHealth(CameraHealth health);
+
+public:
+  // `cap` may be null, in which case the first open() connects the camera.
+  // New frames are handed to `encoder` while the camera has JPEG
+  // subscribers, and to every listener. `onFirstResult` fires once, with
+  // true on the first frame or false on the first failed open.
+  CaptureSession(int cameraId, std::shared_ptr<CameraConfig> config, std::unique_ptr<cv::VideoCapture> cap,
+                 JpegEncoderPool *encoder, std::vector<CapturedFrameListener *> listeners = {},
+                 std::function<void(bool)> onFirstResult = nullptr);
+
+  static std::unique_ptr<cv::VideoCapture> openCapture(const std::string &url);
+
+  int getCameraId() const { return cameraId; }
+  bool isActive() const { return config->active; }
+  bool needsOpen() const { return !cap || !cap->isOpened(); }
+
+  // Opens (or reopens) the source; on failure schedules the next attempt
+  // with exponential backoff.
+  Clock::time_point open();
+  // Reads and publishes one frame; detects stream loss and drops the source
+  // so the next step reopens it.
+  Clock::time_point readFrame();
+
+  // Drives the session on the calling thread until the camera is removed.
+  void run();
+};
+
+// Fixed set of capture threads servicing any number of sessions. Sessions
+// sit in a min-heap keyed by the time they next want to run, and a worker
+// only reads a camera when its next frame is due, so the decoder mostly finds
+// the packet already buffered and the read returns without blocking.
+// Opening a source can block for seconds on RTSP handshakes, so opens are
+// handed to separate connect threads and never stall live cameras.
+class CaptureWorkerPool
+{
+private:
+  struct Entry
+  {
+    CaptureSession::Clock::time_point due;
+    std::shared_ptr<CaptureSession> session;
+
+    bool operator>(const Entry &other) const { return due > other.due; }
+  };
+
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> ready;
+  std::deque<std::shared_ptr<CaptureSession>> connecting;
+  std::mutex queueMutex;
+  std::condition_variable readyChanged;
+  std::condition_variable connectAvailable;
+  std::vector<std::thread> workers;
+  std::vector<std::thread> connectors;
+  bool stopping = false;
+
+  void workerLoop();
+  void connectLoop();
+
+public:
+  CaptureWorkerPool(size_t workerCount, size_t connectorCount);
+  ~CaptureWorkerPool();
+
+  void submit(std::shared_ptr<CaptureSession> session, CaptureSession::Clock::time_point startAt);
+};
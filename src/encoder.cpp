@@ -0,0 +1,386 @@
+#include "encoder.h"
+
+#include "thread_tuning.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+
+shared_ptr<EncodedFrame> EncodedFramePool::acquire()
+{
+  unique_ptr<EncodedFrame> frame;
+  {
+    lock_guard<mutex> lock(poolMutex);
+    if (!available.empty())
+    {
+      frame = move(available.back());
+      available.pop_back();
+    }
+  }
+
+  if (frame)
+  {
+    hits.add();
+    pooledBytes -= frame->jpeg.capacity();
+  }
+  else
+  {
+    misses.add();
+    frame = make_unique<EncodedFrame>();
+  }
+
+  auto pool = shared_from_this();
+  return shared_ptr<EncodedFrame>(frame.release(), [pool](EncodedFrame *released)
+                                  { pool->release(released); });
+}
+
+void EncodedFramePool::release(EncodedFrame *frame)
+{
+  unique_ptr<EncodedFrame> owned(frame);
+  size_t capacity = owned->jpeg.capacity();
+
+  lock_guard<mutex> lock(poolMutex);
+  if (available.size() < maxPooled)
+  {
+    available.push_back(move(owned));
+    pooledBytes += capacity;
+  }
+}
+
+size_t EncodedFramePool::getAvailable()
+{
+  lock_guard<mutex> lock(poolMutex);
+  return available.size();
+}
+
+JpegEncoderPool::JpegEncoderPool(size_t threadCount, int quality)
+    : quality(quality), framePool(make_shared<EncodedFramePool>(256))
+{
+  for (size_t i = 0; i < max<size_t>(threadCount, 1); i++)
+  {
+    workers.emplace_back(&JpegEncoderPool::workerLoop, this);
+  }
+}
+
+JpegEncoderPool::~JpegEncoderPool()
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+  }
+  queueChanged.notify_all();
+  for (auto &worker : workers)
+  {
+    worker.join();
+  }
+}
+
+void JpegEncoderPool::frameReady(const shared_ptr<CameraConfig> &camera)
+{
+  if (!requestEncode(camera))
+  {
+    // The frame still waiting for a worker is superseded by this one.
+    camera->metrics.encodeDropped.add();
+  }
+}
+
+bool JpegEncoderPool::requestEncode(const shared_ptr<CameraConfig> &camera)
+{
+  if (camera->encodeQueued.exchange(true))
+  {
+    return false;
+  }
+  {
+    lock_guard<mutex> lock(queueMutex);
+    pending.push_back(camera);
+  }
+  queueChanged.notify_one();
+  return true;
+}
+
+size_t JpegEncoderPool::getQueueDepth()
+{
+  lock_guard<mutex> lock(queueMutex);
+  return pending.size();
+}
+
+void JpegEncoderPool::workerLoop()
+{
+  applyThreadTuning(ThreadRole::Encode);
+  setTraceThreadName("encoder");
+
+  unique_lock<mutex> lock(queueMutex);
+  while (!stopping)
+  {
+    if (pending.empty())
+    {
+      queueChanged.wait(lock);
+      continue;
+    }
+
+    auto camera = move(pending.front());
+    pending.pop_front();
+    lock.unlock();
+
+    // Cleared before taking the frame so one captured during the encode
+    // queues the camera again.
+    camera->encodeQueued = false;
+    encode(*camera);
+
+    lock.lock();
+  }
+}
+
+void JpegEncoderPool::encode(CameraConfig &camera)
+{
+  Mat frame;
+  FrameInfo info;
+  bool defaultDue;
+  vector<shared_ptr<Rendition>> renditionsDue;
+  // Renditions that come out identical to the default stream, e.g. asked
+  // for before the source size was known; they share its frames.
+  vector<shared_ptr<Rendition>> aliases;
+  {
+    lock_guard<mutex> lock(camera.frameMutex);
+    if (camera.currentFrame.empty())
+    {
+      return;
+    }
+    // Shares the captured buffer; capture replaces rather than overwrites it.
+    frame = camera.currentFrame;
+    info = camera.currentFrameInfo;
+    defaultDue = camera.jpegSubscribers > 0 && !(camera.currentJpeg && camera.currentJpeg->info.seq >= info.seq);
+
+    for (auto &[key, rendition] : camera.renditions)
+    {
+      if (rendition->current && rendition->current->info.seq >= info.seq)
+        continue;
+      if (!key.quality && (!key.width || key.width >= frame.cols) && (!key.height || key.height >= frame.rows))
+        aliases.push_back(rendition);
+      else
+        renditionsDue.push_back(rendition);
+    }
+    if (!aliases.empty())
+      defaultDue = !(camera.currentJpeg && camera.currentJpeg->info.seq >= info.seq);
+  }
+
+  if (defaultDue)
+  {
+    encodeDefault(camera, frame, info);
+  }
+  if (!aliases.empty())
+  {
+    {
+      lock_guard<mutex> lock(camera.frameMutex);
+      for (auto &rendition : aliases)
+      {
+        if (camera.currentJpeg && !(rendition->current && rendition->current->info.seq >= camera.currentJpeg->info.seq))
+          rendition->current = camera.currentJpeg;
+      }
+    }
+    camera.frameAvailable.notify_all();
+  }
+  for (auto &rendition : renditionsDue)
+  {
+    encodeRendition(camera, *rendition, frame, info);
+  }
+}
+
+void JpegEncoderPool::encodeDefault(CameraConfig &camera, const Mat &frame, const FrameInfo &info)
+{
+  auto started = steady_clock::now();
+  auto encoded = framePool->acquire();
+  encoded->info = info;
+  encoded->keyframe = true;
+  {
+    TraceSpan span("encode", camera.id);
+    imencode(".jpg", frame, encoded->jpeg, {IMWRITE_JPEG_QUALITY, quality});
+  }
+  encoded->encodedAt = steady_clock::now();
+
+  camera.latency.encode.record(encoded->encodedAt - started);
+  camera.latency.captureToEncode.record(encoded->encodedAt - info.capturedAt);
+  camera.metrics.framesEncoded.add();
+
+  shared_ptr<const EncodedFrame> published;
+  {
+    lock_guard<mutex> lock(camera.frameMutex);
+    // Two workers can encode consecutive frames of one camera; never let the
+    // slower one replace a newer frame.
+    if (camera.currentJpeg && camera.currentJpeg->info.seq >= info.seq)
+    {
+      return;
+    }
+    encoded->publishedSeq = camera.currentJpeg ? camera.currentJpeg->publishedSeq + 1 : 1;
+    published = move(encoded);
+    camera.currentJpeg = published;
+  }
+  camera.frameAvailable.notify_all();
+  for (auto *listener : listeners)
+  {
+    listener->frameEncoded(camera, published);
+  }
+}
+
+void JpegEncoderPool::encodeRendition(CameraConfig &camera, Rendition &rendition, const Mat &frame,
+                                      const FrameInfo &info)
+{
+  const RenditionKey &key = rendition.key;
+  auto encoded = framePool->acquire();
+  encoded->info = info;
+  encoded->keyframe = true;
+  {
+    TraceSpan span("encode-rendition", camera.id);
+    // Only ever scales down; a missing dimension follows the aspect ratio.
+    int width = key.width > 0 ? min(key.width, frame.cols) : frame.cols;
+    int height = key.height > 0 ? min(key.height, frame.rows) : frame.rows;
+    if (key.width > 0 && key.height <= 0)
+      height = max(1, frame.rows * width / frame.cols);
+    else if (key.height > 0 && key.width <= 0)
+      width = max(1, frame.cols * height / frame.rows);
+
+    Mat scaled = frame;
+    if (width != frame.cols || height != frame.rows)
+    {
+      resize(frame, scaled, Size(width, height), 0, 0, INTER_AREA);
+    }
+    imencode(".jpg", scaled, encoded->jpeg, {IMWRITE_JPEG_QUALITY, key.quality > 0 ? key.quality : quality});
+  }
+  encoded->encodedAt = steady_clock::now();
+  camera.metrics.renditionFramesEncoded.add();
+
+  {
+    lock_guard<mutex> lock(camera.frameMutex);
+    if (rendition.current && rendition.current->info.seq >= info.seq)
+    {
+      return;
+    }
+    encoded->publishedSeq = rendition.current ? rendition.current->publishedSeq + 1 : 1;
+    rendition.current = move(encoded);
+  }
+  camera.frameAvailable.notify_all();
+}
+
+namespace
+{
+  // Requests snap to these steps so that near-identical parameters share a
+  // rendition instead of each costing an encode of every frame.
+  constexpr int widthSteps[] = {160, 240, 320, 480, 640, 960, 1280, 1920, 2560, 3840};
+  constexpr int heightSteps[] = {90, 120, 180, 240, 360, 480, 720, 1080, 1440, 2160};
+  constexpr int qualitySteps[] = {30, 50, 70, 85, 95};
+  // Beyond this many renditions per camera, a new request gets the nearest
+  // existing one.
+  constexpr size_t maxRenditions = 4;
+
+  // The smallest step at least `value`; 0 (the source size) above the last.
+  template <size_t N>
+  int snapUp(int value, const int (&steps)[N])
+  {
+    for (int step : steps)
+    {
+      if (step >= value)
+        return step;
+    }
+    return 0;
+  }
+
+  int snapQuality(int quality)
+  {
+    int best = qualitySteps[0];
+    for (int step : qualitySteps)
+    {
+      if (abs(step - quality) < abs(best - quality))
+        best = step;
+    }
+    return best;
+  }
+
+  int distance(const RenditionKey &a, const RenditionKey &b)
+  {
+    return abs(a.width - b.width) + abs(a.height - b.height) + 10 * abs(a.quality - b.quality);
+  }
+}
+
+JpegSubscription::JpegSubscription(JpegEncoderPool &encoder, shared_ptr<CameraConfig> camera, RenditionKey key)
+    : camera(move(camera))
+{
+  if (key.width > 0)
+    key.width = snapUp(key.width, widthSteps);
+  if (key.height > 0)
+    key.height = snapUp(key.height, heightSteps);
+  if (key.quality > 0)
+    key.quality = snapQuality(key.quality);
+  if (key.quality == encoder.getQuality())
+    key.quality = 0;
+
+  {
+    lock_guard<mutex> lock(this->camera->frameMutex);
+    firstSeq = this->camera->currentFrameInfo.seq;
+    // Sizes at or above the source's are the source size; a rendition asked
+    // for before the first frame is aliased to the default by the encoder.
+    const Mat &source = this->camera->currentFrame;
+    if (!source.empty())
+    {
+      if (key.width >= source.cols)
+        key.width = 0;
+      if (key.height >= source.rows)
+        key.height = 0;
+    }
+    if (!key.isDefault())
+    {
+      auto &renditions = this->camera->renditions;
+      auto it = renditions.find(key);
+      if (it == renditions.end() && renditions.size() >= maxRenditions)
+      {
+        it = min_element(renditions.begin(), renditions.end(), [&](auto &a, auto &b)
+                         { return distance(a.first, key) < distance(b.first, key); });
+      }
+      if (it == renditions.end())
+      {
+        auto created = make_shared<Rendition>();
+        created->key = key;
+        it = renditions.emplace(key, move(created)).first;
+      }
+      it->second->subscribers++;
+      rendition = it->second;
+    }
+  }
+  if (rendition)
+    this->camera->renditionSubscribers++;
+  else
+    this->camera->jpegSubscribers++;
+  encoder.requestEncode(this->camera);
+}
+
+JpegSubscription::~JpegSubscription()
+{
+  if (!rendition)
+  {
+    camera->jpegSubscribers--;
+    return;
+  }
+  camera->renditionSubscribers--;
+  lock_guard<mutex> lock(camera->frameMutex);
+  if (--rendition->subscribers == 0)
+  {
+    camera->renditions.erase(rendition->key);
+  }
+}
+
+bool FrameRateLimiter::due(int64_t timeUs) const
+{
+  // A frame up to a quarter interval early still counts, so jitter doesn't
+  // push the send to the frame after.
+  return !intervalUs || !nextDueUs || timeUs + intervalUs / 4 >= nextDueUs || nextDueUs - timeUs > 1000000;
+}
+
+void FrameRateLimiter::sent(int64_t timeUs)
+{
+  if (!intervalUs)
+    return;
+  if (!nextDueUs || timeUs - nextDueUs >= intervalUs || nextDueUs - timeUs > 1000000)
+    nextDueUs = timeUs + intervalUs;
+  else
+    nextDueUs += intervalUs;
+}
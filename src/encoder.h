@@ -0,0 +1,138 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "camera.h"
+
+// Recycles EncodedFrame objects, and with them their JPEG buffers, once the
+// last viewer drops a frame. Encoded frames are tens to hundreds of KB, which
+// glibc serves with fresh mmap()s; reusing them avoids a page-fault storm per
+// frame per camera.
+class EncodedFramePool : public std::enable_shared_from_this<EncodedFramePool>
+{
+private:
+  std::mutex poolMutex;
+  std::vector<std::unique_ptr<EncodedFrame>> available;
+  size_t maxPooled;
+  std::atomic<size_t> pooledBytes{0};
+  ShardedCounter hits;
+  ShardedCounter misses;
+
+  void release(EncodedFrame *frame);
+
+public:
+  explicit EncodedFramePool(size_t maxPooled) : maxPooled(maxPooled) {}
+
+  std::shared_ptr<EncodedFrame> acquire();
+
+  uint64_t getHits() const { return hits.value(); }
+  uint64_t getMisses() const { return misses.value(); }
+  size_t getPooledBytes() const { return pooledBytes; }
+  size_t getAvailable();
+};
+
+// Sees every frame the encoder pool publishes, on the encoder thread that
+// produced it; implementations must only queue the frame, never block.
+class EncodedFrameListener
+{
+public:
+  virtual ~EncodedFrameListener() = default;
+  virtual void frameEncoded(CameraConfig &camera, const std::shared_ptr<const EncodedFrame> &frame) = 0;
+};
+
+// Encodes each captured frame to JPEG once, on a fixed set of threads, and
+// publishes the result as the camera's currentJpeg for all viewers to share.
+// Renditions viewers asked for are encoded from the same frame in the same
+// job, each once no matter how many viewers share it.
+// A camera is queued at most once; a worker always encodes the newest frame,
+// so when encoding falls behind, intermediate frames are skipped rather than
+// queued up as latency.
+class JpegEncoderPool
+{
+private:
+  int quality;
+  std::shared_ptr<EncodedFramePool> framePool;
+  std::deque<std::shared_ptr<CameraConfig>> pending;
+  std::mutex queueMutex;
+  std::condition_variable queueChanged;
+  std::vector<std::thread> workers;
+  std::vector<EncodedFrameListener *> listeners;
+  bool stopping = false;
+
+  void workerLoop();
+  void encode(CameraConfig &camera);
+  void encodeDefault(CameraConfig &camera, const cv::Mat &frame, const FrameInfo &info);
+  void encodeRendition(CameraConfig &camera, Rendition &rendition, const cv::Mat &frame, const FrameInfo &info);
+
+public:
+  JpegEncoderPool(size_t threadCount, int quality);
+  ~JpegEncoderPool();
+
+  // Called by capture after publishing a new frame.
+  void frameReady(const std::shared_ptr<CameraConfig> &camera);
+  // Queues the camera's current frame; false if it is already queued.
+  bool requestEncode(const std::shared_ptr<CameraConfig> &camera);
+  // Not synchronized with encoding; add listeners before capture starts.
+  void addListener(EncodedFrameListener *listener) { listeners.push_back(listener); }
+
+  size_t getQueueDepth();
+  size_t getThreadCount() const { return workers.size(); }
+  int getQuality() const { return quality; }
+  EncodedFramePool &getFramePool() { return *framePool; }
+};
+
+// Keeps a camera's frames being encoded for as long as it is alive, in the
+// default rendition or the one `key` asks for. Sizes and quality snap to a
+// small set of steps, sizes at or above the source's mean the source size,
+// and a camera has at most a few renditions (later requests share the
+// nearest one), so viewers can't multiply the encoding work. On creation the current frame
+// is encoded right away, so a new viewer doesn't have to wait for the next
+// capture; minSeq() is the first sequence number the subscriber should
+// accept (anything older predates the subscription).
+class JpegSubscription
+{
+private:
+  std::shared_ptr<CameraConfig> camera;
+  std::shared_ptr<Rendition> rendition;
+  uint64_t firstSeq;
+
+public:
+  JpegSubscription(JpegEncoderPool &encoder, std::shared_ptr<CameraConfig> camera, RenditionKey key = {});
+  ~JpegSubscription();
+
+  JpegSubscription(const JpegSubscription &) = delete;
+  JpegSubscription &operator=(const JpegSubscription &) = delete;
+
+  uint64_t minSeq() const { return firstSeq; }
+  // The newest frame of the subscribed rendition; call with the camera's
+  // frameMutex held.
+  const std::shared_ptr<const EncodedFrame> &latest() const
+  {
+    return rendition ? rendition->current : camera->currentJpeg;
+  }
+};
+
+// Thins a viewer's stream to `fps` by choosing which of the shared encoded
+// frames to send, by capture time, so a slow viewer costs fewer sends and
+// never an extra encode. Sends keep to a steady cadence rather than drifting
+// with capture jitter, and re-sync after a gap or a jump of the clock. 0
+// passes every frame.
+class FrameRateLimiter
+{
+private:
+  int64_t intervalUs;
+  int64_t nextDueUs = 0;
+
+public:
+  explicit FrameRateLimiter(int fps = 0) : intervalUs(fps > 0 ? 1000000 / fps : 0) {}
+
+  bool limited() const { return intervalUs > 0; }
+  // Whether the frame captured at `timeUs` should go out.
+  bool due(int64_t timeUs) const;
+  // Records that the frame captured at `timeUs` went out.
+  void sent(int64_t timeUs);
+};
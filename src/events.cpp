@@ -0,0 +1,290 @@
+#include "events.h"
+
+#include <algorithm>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "include/crow_all.h"
+#include "logger.h"
+#include "trace.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  // Stream stats change every frame; they go out at most this often.
+  constexpr auto statsInterval = seconds(1);
+  // Unsent bytes beyond which a client counts as not reading, whatever its
+  // send buffer size.
+  constexpr int maxUnsentBytes = 256 * 1024;
+
+  // True while at least half the socket's send buffer is still unsent. Crow
+  // queues messages without limit once the socket is full, so nothing more
+  // is handed to it until the client reads.
+  bool backlogged(int fd)
+  {
+    int unsent = 0;
+    int sendBuffer = 0;
+    socklen_t size = sizeof(sendBuffer);
+    if (fd < 0 || ioctl(fd, SIOCOUTQ, &unsent) != 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, &size) != 0)
+      return false;
+    return unsent >= min(sendBuffer / 2, maxUnsentBytes);
+  }
+
+  string batchMessage(const vector<const string *> &events)
+  {
+    size_t size = 16;
+    for (auto *event : events)
+    {
+      size += event->size() + 1;
+    }
+    string message;
+    message.reserve(size);
+    message += "{\"events\":[";
+    for (size_t i = 0; i < events.size(); i++)
+    {
+      if (i > 0)
+        message += ',';
+      message += *events[i];
+    }
+    message += "]}";
+    return message;
+  }
+}
+
+EventHub::EventHub(function<CameraList()> listCameras, milliseconds batchInterval)
+    : listCameras(move(listCameras)), batchInterval(batchInterval)
+{
+  broadcaster = thread(&EventHub::broadcastLoop, this);
+}
+
+EventHub::~EventHub()
+{
+  {
+    lock_guard<mutex> lock(stateMutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  broadcaster.join();
+}
+
+void EventHub::publish(int cameraId, const string &type, const string &data)
+{
+  string event = "{\"camera\":" + to_string(cameraId) + ",\"type\":\"" + type + "\",\"data\":" + data + "}";
+  lock_guard<mutex> lock(eventsMutex);
+  string &last = latest[{cameraId, type}];
+  if (last == event)
+    return;
+  pending[{cameraId, type}] = event;
+  last = move(event);
+}
+
+void EventHub::motionChanged(int cameraId, const MotionState &state)
+{
+  vector<crow::json::wvalue> boxes;
+  for (auto &box : state.boxes)
+  {
+    crow::json::wvalue json;
+    json["x"] = box.x;
+    json["y"] = box.y;
+    json["width"] = box.width;
+    json["height"] = box.height;
+    boxes.push_back(move(json));
+  }
+  crow::json::wvalue json;
+  json["active"] = state.active;
+  json["score"] = state.score;
+  json["boxes"] = move(boxes);
+  json["timeUs"] = state.timeUs;
+  json["eventStartUs"] = state.eventStartUs;
+  json["events"] = state.events;
+  publish(cameraId, "motion", json.dump());
+}
+
+void EventHub::addClient(crow::websocket::connection *client, int socketFd)
+{
+  Client state;
+  state.socketFd = socketFd;
+  lock_guard<mutex> lock(clientsMutex);
+  clients[client] = move(state);
+}
+
+void EventHub::removeClient(crow::websocket::connection *client)
+{
+  // Once this returns the broadcaster can no longer reach the connection,
+  // so Crow is free to delete it.
+  lock_guard<mutex> lock(clientsMutex);
+  clients.erase(client);
+}
+
+bool EventHub::handleMessage(crow::websocket::connection *client, const string &message)
+{
+  auto json = crow::json::load(message);
+  if (!json || json.t() != crow::json::type::Object || !json.has("subscribe"))
+    return false;
+
+  vector<int> cameras;
+  auto &subscribe = json["subscribe"];
+  if (subscribe.t() == crow::json::type::List)
+  {
+    for (auto &id : subscribe)
+    {
+      if (id.t() != crow::json::type::Number)
+        return false;
+      cameras.push_back(id.i());
+    }
+    sort(cameras.begin(), cameras.end());
+    cameras.erase(unique(cameras.begin(), cameras.end()), cameras.end());
+  }
+  else if (subscribe.t() != crow::json::type::String || subscribe.s() != "all")
+  {
+    return false;
+  }
+
+  lock_guard<mutex> lock(clientsMutex);
+  auto it = clients.find(client);
+  if (it == clients.end())
+    return false;
+  it->second.cameras = move(cameras);
+  it->second.needsSnapshot = true;
+  return true;
+}
+
+size_t EventHub::getClientCount()
+{
+  lock_guard<mutex> lock(clientsMutex);
+  return clients.size();
+}
+
+// Health and stats live in the cameras' atomics; reading them once per batch
+// is cheaper than hooking every state change and coalesces them for free.
+void EventHub::sampleCameras(bool withStats, map<int, CameraHealth> &lastHealth)
+{
+  map<int, CameraHealth> seen;
+  for (auto &[id, camera] : listCameras())
+  {
+    CameraHealth health = camera->health;
+    seen[id] = health;
+    auto previous = lastHealth.find(id);
+    if (previous == lastHealth.end() || previous->second != health)
+    {
+      publish(id, "health", string("{\"state\":\"") + healthName(health) + "\"}");
+    }
+
+    if (withStats)
+    {
+      CameraMetrics &metrics = camera->metrics;
+      crow::json::wvalue json;
+      json["captureFps"] = metrics.captureFps.load();
+      json["viewers"] = metrics.viewers.load();
+      json["framesCaptured"] = metrics.framesCaptured.value();
+      json["framesEncoded"] = metrics.framesEncoded.value();
+      json["framesSent"] = metrics.framesSent.value();
+      json["bytesSent"] = metrics.bytesSent.value();
+      json["encodeDropped"] = metrics.encodeDropped.value();
+      json["sendDropped"] = metrics.sendDropped.value();
+      publish(id, "stats", json.dump());
+    }
+  }
+
+  for (auto &[id, health] : lastHealth)
+  {
+    if (!seen.count(id))
+    {
+      publish(id, "health", "{\"state\":\"removed\"}");
+      lock_guard<mutex> lock(eventsMutex);
+      // Nothing about a removed camera belongs in later snapshots.
+      for (auto it = latest.lower_bound({id, ""}); it != latest.end() && it->first.first == id;)
+      {
+        it = latest.erase(it);
+      }
+    }
+  }
+  lastHealth = move(seen);
+}
+
+void EventHub::broadcastLoop()
+{
+  setTraceThreadName("events");
+
+  map<int, CameraHealth> lastHealth;
+  auto nextStats = steady_clock::now();
+  unique_lock<mutex> stateLock(stateMutex);
+  while (!stopping)
+  {
+    stateLock.unlock();
+
+    auto now = steady_clock::now();
+    bool withStats = now >= nextStats;
+    if (withStats)
+      nextStats = now + statsInterval;
+    sampleCameras(withStats, lastHealth);
+
+    map<EventKey, string> batch;
+    {
+      lock_guard<mutex> lock(eventsMutex);
+      batch.swap(pending);
+    }
+
+    {
+      TraceSpan span("events");
+      // One serialization per distinct subscription, shared by every client
+      // that has it.
+      map<vector<int>, string> messages;
+      auto messageFor = [&](const map<EventKey, string> &events, const vector<int> &cameras)
+      {
+        vector<const string *> selected;
+        for (auto &[key, event] : events)
+        {
+          if (cameras.empty() || binary_search(cameras.begin(), cameras.end(), key.first))
+            selected.push_back(&event);
+        }
+        return selected.empty() ? string() : batchMessage(selected);
+      };
+
+      map<EventKey, string> snapshot;
+      bool haveSnapshot = false;
+
+      lock_guard<mutex> lock(clientsMutex);
+      for (auto &[connection, client] : clients)
+      {
+        if (backlogged(client.socketFd))
+        {
+          // Whatever it misses now is covered by the snapshot.
+          if (!client.needsSnapshot)
+            LOG_DEBUG("Events client %s is not reading; skipping it", connection->get_remote_ip().c_str());
+          client.needsSnapshot = true;
+          continue;
+        }
+
+        string message;
+        if (client.needsSnapshot)
+        {
+          if (!haveSnapshot)
+          {
+            lock_guard<mutex> eventsLock(eventsMutex);
+            snapshot = latest;
+            haveSnapshot = true;
+          }
+          client.needsSnapshot = false;
+          message = messageFor(snapshot, client.cameras);
+        }
+        else if (!batch.empty())
+        {
+          auto cached = messages.find(client.cameras);
+          if (cached == messages.end())
+            cached = messages.emplace(client.cameras, messageFor(batch, client.cameras)).first;
+          message = cached->second;
+        }
+        if (!message.empty())
+          connection->send_text(move(message));
+      }
+    }
+
+    stateLock.lock();
+    wake.wait_for(stateLock, batchInterval, [&]
+                  { return stopping; });
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "camera.h"
+#include "motion.h"
+
+namespace crow
+{
+  namespace websocket
+  {
+    struct connection;
+  }
+}
+
+// Pushes camera events to WebSocket clients: health changes, motion state
+// and stream stats. Producers only record the latest event per camera and
+// type; once per batch interval everything that changed goes out as one
+// message, serialized once per distinct subscription rather than per
+// client, so a burst of updates costs each client at most one message per
+// interval no matter how many cameras or events are behind it. An event
+// identical to the last one of its camera and type isn't sent again, and a
+// client that doesn't read its messages is skipped until it catches up,
+// then sent the latest of everything, so nothing piles up in memory for it.
+//
+// Messages are {"events": [{"camera": 1, "type": "health", "data": {...}}]}.
+// A client receives all cameras until it sends {"subscribe": [1, 2]} (or
+// "all"); after (re)subscribing it first gets the latest event of every type
+// for its cameras.
+class EventHub
+{
+public:
+  using CameraList = std::vector<std::pair<int, std::shared_ptr<CameraConfig>>>;
+
+private:
+  struct Client
+  {
+    // Empty means every camera.
+    std::vector<int> cameras;
+    bool needsSnapshot = true;
+    // The connection's socket, to check its send queue; -1 if unknown.
+    int socketFd = -1;
+  };
+  using EventKey = std::pair<int, std::string>;
+
+  std::function<CameraList()> listCameras;
+  std::chrono::milliseconds batchInterval;
+
+  std::mutex eventsMutex;
+  // Serialized events by (camera, type): the newest ever, and those not yet sent.
+  std::map<EventKey, std::string> latest;
+  std::map<EventKey, std::string> pending;
+
+  std::mutex clientsMutex;
+  std::map<crow::websocket::connection *, Client> clients;
+
+  std::mutex stateMutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread broadcaster;
+
+  void broadcastLoop();
+  void sampleCameras(bool withStats, std::map<int, CameraHealth> &lastHealth);
+
+public:
+  EventHub(std::function<CameraList()> listCameras, std::chrono::milliseconds batchInterval);
+  ~EventHub();
+
+  // `data` is the event's serialized JSON. Replaces an unsent event of the
+  // same camera and type; dropped if it repeats the latest one.
+  void publish(int cameraId, const std::string &type, const std::string &data);
+  void motionChanged(int cameraId, const MotionState &state);
+
+  void addClient(crow::websocket::connection *client, int socketFd);
+  void removeClient(crow::websocket::connection *client);
+  // Applies a {"subscribe": ...} message; false if it isn't one.
+  bool handleMessage(crow::websocket::connection *client, const std::string &message);
+  size_t getClientCount();
+};
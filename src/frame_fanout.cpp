@@ -0,0 +1,62 @@
+#include "frame_fanout.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+void FrameMailbox::deliver(int cameraId, const shared_ptr<const EncodedFrame> &frame)
+{
+  {
+    lock_guard<mutex> lock(mailboxMutex);
+    newest[cameraId] = frame;
+  }
+  delivered.notify_one();
+}
+
+vector<pair<int, shared_ptr<const EncodedFrame>>> FrameMailbox::take(milliseconds timeout)
+{
+  vector<pair<int, shared_ptr<const EncodedFrame>>> frames;
+  unique_lock<mutex> lock(mailboxMutex);
+  delivered.wait_for(lock, timeout, [&]
+                     { return !newest.empty(); });
+  frames.reserve(newest.size());
+  for (auto &[id, frame] : newest)
+  {
+    frames.emplace_back(id, move(frame));
+  }
+  newest.clear();
+  return frames;
+}
+
+void FrameFanout::add(FrameMailbox *mailbox, const vector<int> &cameraIds)
+{
+  lock_guard<mutex> lock(fanoutMutex);
+  for (int id : cameraIds)
+  {
+    mailboxes[id].push_back(mailbox);
+  }
+}
+
+void FrameFanout::remove(FrameMailbox *mailbox)
+{
+  lock_guard<mutex> lock(fanoutMutex);
+  for (auto it = mailboxes.begin(); it != mailboxes.end();)
+  {
+    auto &registered = it->second;
+    registered.erase(std::remove(registered.begin(), registered.end(), mailbox), registered.end());
+    it = registered.empty() ? mailboxes.erase(it) : next(it);
+  }
+}
+
+void FrameFanout::frameEncoded(CameraConfig &camera, const shared_ptr<const EncodedFrame> &frame)
+{
+  lock_guard<mutex> lock(fanoutMutex);
+  auto it = mailboxes.find(camera.id);
+  if (it == mailboxes.end())
+    return;
+  for (auto *mailbox : it->second)
+  {
+    mailbox->deliver(camera.id, frame);
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "encoder.h"
+
+// Collects the newest encoded frame of each of a set of cameras for one
+// consumer, so a single thread can serve several cameras at their own rates:
+// a slow camera never holds up a fast one, and frames published while the
+// consumer is busy replace each other instead of queueing.
+class FrameMailbox
+{
+private:
+  std::mutex mailboxMutex;
+  std::condition_variable delivered;
+  std::map<int, std::shared_ptr<const EncodedFrame>> newest;
+
+public:
+  void deliver(int cameraId, const std::shared_ptr<const EncodedFrame> &frame);
+  // Waits up to `timeout` for at least one frame, then returns the newest
+  // frame of every camera that published since the last call.
+  std::vector<std::pair<int, std::shared_ptr<const EncodedFrame>>> take(std::chrono::milliseconds timeout);
+};
+
+// Hands every encoded frame to the mailboxes registered for its camera.
+class FrameFanout : public EncodedFrameListener
+{
+private:
+  std::mutex fanoutMutex;
+  std::map<int, std::vector<FrameMailbox *>> mailboxes;
+
+public:
+  void add(FrameMailbox *mailbox, const std::vector<int> &cameraIds);
+  void remove(FrameMailbox *mailbox);
+
+  void frameEncoded(CameraConfig &camera, const std::shared_ptr<const EncodedFrame> &frame) override;
+};
@@ -0,0 +1,334 @@
+#include "http_server.h"
+
+#include <array>
+#include <string>
+#include <thread>
+#include "logger.h"
+#include "thread_tuning.h"
+#include "trace.h"
+
+using namespace boost::asio;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  // Request line plus headers; anything bigger is rejected.
+  constexpr size_t maxHeaderBytes = 16 * 1024;
+  // The API only takes small JSON bodies.
+  constexpr size_t maxBodyBytes = 1024 * 1024;
+  // Pause before accepting again after a failed accept, e.g. when out of
+  // file descriptors, instead of spinning on the error.
+  constexpr auto acceptRetryDelay = milliseconds(100);
+
+  // Set around handing a socket to a WebSocket route; see upgradingSocket().
+  thread_local int upgradingFd = -1;
+
+  const char *statusText(int code)
+  {
+    switch (code)
+    {
+    case 101:
+      return "Switching Protocols";
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
+    case 301:
+      return "Moved Permanently";
+    case 304:
+      return "Not Modified";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 409:
+      return "Conflict";
+    case 413:
+      return "Payload Too Large";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 500:
+      return "Internal Server Error";
+    case 503:
+      return "Service Unavailable";
+    }
+    return "";
+  }
+}
+
+class HttpServer::Connection : public enable_shared_from_this<Connection>
+{
+private:
+  HttpServer &server;
+  ip::tcp::socket socket;
+  steady_timer timer;
+  crow::HTTPParser<Connection> parser;
+  array<char, 4096> readBuffer;
+  // Progress of the request being read.
+  bool requestStarted = false;
+  bool headersComplete = false;
+  bool requestComplete = false;
+  size_t headerBytes = 0;
+  steady_clock::time_point requestDeadline;
+  crow::response response;
+  string head;
+
+  // Closing the socket fails the pending read, which drops the connection.
+  void armTimer(steady_clock::time_point deadline)
+  {
+    timer.expires_at(deadline);
+    timer.async_wait([self = shared_from_this()](const boost::system::error_code &error)
+                     {
+      if (error)
+        return;
+      if (self->requestStarted && !self->requestComplete)
+      {
+        self->server.requestTimeouts.add();
+        LOG_DEBUG("Closing connection whose request took too long");
+      }
+      boost::system::error_code ignored;
+      self->socket.close(ignored); });
+  }
+
+  void read()
+  {
+    socket.async_read_some(buffer(readBuffer), [self = shared_from_this()](const boost::system::error_code &error, size_t size)
+                           {
+      if (error)
+        return;
+      if (!self->requestStarted)
+      {
+        // Both deadlines run from the first byte and aren't extended by
+        // later ones, so trickling bytes doesn't keep a connection.
+        self->requestStarted = true;
+        auto now = steady_clock::now();
+        self->requestDeadline = now + self->server.requestTimeout;
+        self->armTimer(now + self->server.headerTimeout);
+      }
+      bool readingHeaders = !self->headersComplete;
+      if (readingHeaders)
+        self->headerBytes += size;
+      if (!self->parser.feed(self->readBuffer.data(), (int)size))
+      {
+        self->server.rejectedRequests.add();
+        self->respond(crow::response(400), false);
+        return;
+      }
+      // Checked even if this read completed the headers; a read is small
+      // enough that counting it whole doesn't matter.
+      if (readingHeaders && self->headerBytes > maxHeaderBytes)
+      {
+        self->server.rejectedRequests.add();
+        self->respond(crow::response(431), false);
+        return;
+      }
+      if (self->headersComplete && !self->requestComplete)
+      {
+        // Chunked bodies declare no length, so the received size is checked too.
+        uint64_t declared = self->parser.content_length;
+        if ((declared != UINT64_MAX && declared > maxBodyBytes) || self->parser.req.body.size() > maxBodyBytes)
+        {
+          self->server.rejectedRequests.add();
+          self->respond(crow::response(413), false);
+          return;
+        }
+      }
+      if (!self->requestComplete)
+      {
+        if (readingHeaders && self->headersComplete)
+          self->armTimer(self->requestDeadline);
+        self->read();
+        return;
+      }
+      self->dispatch(); });
+  }
+
+  void dispatch()
+  {
+    timer.cancel();
+    crow::request &request = parser.req;
+    boost::system::error_code error;
+    request.remote_ip_address = socket.remote_endpoint(error).address().to_string();
+    LOG_DEBUG("%s %s from %s", crow::method_name(request.method).c_str(), request.raw_url.c_str(),
+              request.remote_ip_address.c_str());
+
+    if (request.upgrade && crow::utility::string_equals(request.get_header_value("upgrade"), "websocket"))
+    {
+      // The WebSocket connection owns the socket from here on, on this loop.
+      crow::SocketAdaptor adaptor(static_cast<io_context &>(socket.get_executor().context()), nullptr);
+      adaptor.raw_socket() = move(socket);
+      crow::response ignored;
+      upgradingFd = adaptor.raw_socket().native_handle();
+      server.app.handle_upgrade(request, ignored, move(adaptor));
+      upgradingFd = -1;
+      return;
+    }
+
+    if (server.streams)
+    {
+      // Asio switches the socket back to non-blocking for any later async
+      // operation, so this is harmless when the handler declines.
+      socket.native_non_blocking(false, error);
+      if (server.streams(socket, request))
+        return;
+    }
+
+    response = crow::response();
+    server.app.handle_full(request, response);
+    respond(move(response), request.keep_alive && !request.close_connection);
+  }
+
+  void respond(crow::response result, bool keepAlive)
+  {
+    response = move(result);
+    if (response.code >= 400 && response.body.empty())
+      response.body = statusText(response.code);
+
+    head = "HTTP/1.1 " + to_string(response.code) + " " + statusText(response.code) + "\r\n";
+    for (auto &[name, value] : response.headers)
+    {
+      head += name + ": " + value + "\r\n";
+    }
+    if (!response.manual_length_header && !response.headers.count("content-length"))
+      head += "Content-Length: " + to_string(response.body.size()) + "\r\n";
+    head += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    array<const_buffer, 2> parts = {buffer(head), buffer(response.body)};
+    async_write(socket, parts, [self = shared_from_this(), keepAlive](const boost::system::error_code &error, size_t)
+                {
+      if (error)
+        return;
+      if (!keepAlive)
+      {
+        boost::system::error_code ignored;
+        self->socket.shutdown(ip::tcp::socket::shutdown_both, ignored);
+        self->socket.close(ignored);
+        return;
+      }
+      self->response = crow::response();
+      self->head.clear();
+      self->parser.clear();
+      self->requestStarted = false;
+      self->headersComplete = false;
+      self->requestComplete = false;
+      self->headerBytes = 0;
+      self->armTimer(steady_clock::now() + self->server.idleTimeout);
+      self->read(); });
+  }
+
+public:
+  Connection(HttpServer &server, io_context &loop) : server(server), socket(loop), timer(loop), parser(this)
+  {
+    server.openConnections++;
+  }
+  ~Connection() { server.openConnections--; }
+
+  ip::tcp::socket &getSocket() { return socket; }
+
+  void start()
+  {
+    armTimer(steady_clock::now() + server.idleTimeout);
+    read();
+  }
+
+  // Called by crow::HTTPParser, which expects these names.
+  void handle_url() {}
+  void handle_header() { headersComplete = true; }
+  void handle() { requestComplete = true; }
+};
+
+HttpServer::HttpServer(crow::SimpleApp &app, StreamHandler streams, size_t threadCount, seconds idleTimeout,
+                       seconds headerTimeout, seconds requestTimeout)
+    : app(app), streams(move(streams)), idleTimeout(idleTimeout), headerTimeout(headerTimeout),
+      requestTimeout(max(requestTimeout, headerTimeout))
+{
+  for (size_t i = 0; i < max<size_t>(threadCount, 1); i++)
+  {
+    loops.push_back(make_unique<io_context>(1));
+  }
+}
+
+void HttpServer::listen(uint16_t port)
+{
+  // The kernel spreads incoming connections over the loops' acceptors.
+  using reusePort = detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+  ip::tcp::endpoint endpoint(ip::tcp::v4(), port);
+  for (auto &loop : loops)
+  {
+    auto acceptor = make_unique<ip::tcp::acceptor>(*loop);
+    acceptor->open(endpoint.protocol());
+    acceptor->set_option(socket_base::reuse_address(true));
+    acceptor->set_option(reusePort(true));
+    acceptor->bind(endpoint);
+    acceptor->listen(socket_base::max_listen_connections);
+    accept(*acceptor, *loop);
+    acceptors.push_back(move(acceptor));
+  }
+  LOG_INFO("HTTP server listening on port %u", (unsigned)port);
+}
+
+void HttpServer::accept(ip::tcp::acceptor &acceptor, io_context &loop)
+{
+  auto connection = make_shared<Connection>(*this, loop);
+  acceptor.async_accept(connection->getSocket(), [this, &acceptor, &loop, connection](const boost::system::error_code &error)
+                        {
+    if (error == error::operation_aborted)
+      return;
+    if (!error)
+    {
+      connection->start();
+      accept(acceptor, loop);
+      return;
+    }
+    LOG_RATE_LIMITED(LogLevel::Warning, 1, "Accepting a connection failed: %s", error.message().c_str());
+    auto retry = make_shared<steady_timer>(loop, acceptRetryDelay);
+    retry->async_wait([this, &acceptor, &loop, retry](const boost::system::error_code &timerError)
+                      {
+      if (!timerError)
+        accept(acceptor, loop); }); });
+}
+
+void HttpServer::run()
+{
+  app.validate();
+
+  vector<executor_work_guard<io_context::executor_type>> work;
+  for (auto &loop : loops)
+  {
+    work.push_back(make_work_guard(*loop));
+  }
+  auto runLoop = [this](size_t index)
+  {
+    applyThreadTuning(ThreadRole::Network);
+    setTraceThreadName("http-" + to_string(index));
+    loops[index]->run();
+  };
+  vector<thread> threads;
+  for (size_t i = 1; i < loops.size(); i++)
+  {
+    threads.emplace_back(runLoop, i);
+  }
+  runLoop(0);
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+}
+
+void HttpServer::stop()
+{
+  for (auto &loop : loops)
+  {
+    loop->stop();
+  }
+}
+
+int HttpServer::upgradingSocket()
+{
+  return upgradingFd;
+}
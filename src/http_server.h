@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <boost/asio.hpp>
+#include "include/crow_all.h"
+#include "sharded_counter.h"
+
+// The one HTTP engine for the REST API and the live streams. Every port it
+// listens on serves the same routes: requests are parsed incrementally with
+// Crow's parser on a pool of event loops, ordinary requests go through the
+// Crow app's router and stay on the connection for keep-alive, WebSocket
+// upgrades are handed to the app's WebSocket routes, and stream requests
+// get the socket for a long-lived response.
+//
+// Like Crow's own server, each event loop runs on exactly one thread and a
+// connection stays on the loop it was accepted on, so handlers of one
+// connection never run concurrently. Every loop has its own SO_REUSEPORT
+// acceptor, so accepting scales with the loops and nothing a client does
+// can hold up connections on other loops. A request's headers must arrive
+// within the header timeout and its body within the request timeout, both
+// counted from the first byte however slowly it trickles in; headers and
+// bodies are capped in size.
+class HttpServer
+{
+public:
+  // Takes over the connection for a streamed response, usually on a thread
+  // of its own; returns false to let the app's routes answer the request.
+  // The socket is in blocking mode.
+  using StreamHandler = std::function<bool(boost::asio::ip::tcp::socket &socket, const crow::request &request)>;
+
+private:
+  class Connection;
+
+  crow::SimpleApp &app;
+  StreamHandler streams;
+  std::chrono::seconds idleTimeout;
+  std::chrono::seconds headerTimeout;
+  std::chrono::seconds requestTimeout;
+  std::vector<std::unique_ptr<boost::asio::io_context>> loops;
+  std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+
+  std::atomic<int> openConnections{0};
+  ShardedCounter requestTimeouts;
+  ShardedCounter rejectedRequests;
+
+  void accept(boost::asio::ip::tcp::acceptor &acceptor, boost::asio::io_context &loop);
+
+public:
+  HttpServer(crow::SimpleApp &app, StreamHandler streams, size_t threadCount, std::chrono::seconds idleTimeout,
+             std::chrono::seconds headerTimeout, std::chrono::seconds requestTimeout);
+
+  void listen(uint16_t port);
+  // Runs the event loops, one on the calling thread; returns after stop().
+  void run();
+  void stop();
+
+  // Connections still being read by the event loops; streams handed off
+  // are not counted.
+  int getOpenConnections() const { return openConnections; }
+  // Requests whose headers or body didn't arrive in time.
+  uint64_t getRequestTimeouts() const { return requestTimeouts.value(); }
+  // Malformed requests and oversized headers or bodies.
+  uint64_t getRejectedRequests() const { return rejectedRequests.value(); }
+
+  // The socket being upgraded to a WebSocket on the calling thread, or -1.
+  // Valid inside a WebSocket route's accept handler, which can keep it to
+  // watch the connection's send queue; Crow's connection doesn't expose it.
+  static int upgradingSocket();
+};
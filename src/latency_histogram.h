@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Lock-free latency histogram with four log-spaced buckets per power of two
+// microseconds (~19% resolution) covering 1us to ~35 minutes. Recording is
+// a couple of relaxed atomic increments, so it is safe on hot paths and from
+// any number of threads; percentiles report the upper bound of the bucket.
+class LatencyHistogram
+{
+public:
+  static constexpr int bucketCount = 128;
+
+private:
+  std::array<std::atomic<uint64_t>, bucketCount> buckets{};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sumUs{0};
+
+  static int bucketFor(uint64_t us)
+  {
+    if (us < 4)
+      return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int sub = (int)((us >> (msb - 2)) & 3);
+    int index = msb * 4 + sub;
+    return index < bucketCount ? index : bucketCount - 1;
+  }
+
+public:
+  static uint64_t bucketUpperBoundUs(int index)
+  {
+    if (index < 4)
+      return index + 1;
+    // Values from 4us up start at index 8, so 4-7 stay empty; give them the
+    // bound of the bucket before to keep bounds increasing.
+    if (index < 8)
+      return 4;
+    int msb = index / 4;
+    int sub = index % 4;
+    return (uint64_t)(4 + sub + 1) << (msb - 2);
+  }
+
+  void record(std::chrono::steady_clock::duration elapsed)
+  {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint64_t value = us > 0 ? (uint64_t)us : 0;
+    buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sumUs.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+  uint64_t getSumUs() const { return sumUs.load(std::memory_order_relaxed); }
+  uint64_t getBucket(int index) const { return buckets[index].load(std::memory_order_relaxed); }
+
+  uint64_t percentileUs(double percentile) const
+  {
+    uint64_t total = getCount();
+    if (total == 0)
+      return 0;
+
+    uint64_t rank = std::min(total - 1, (uint64_t)(percentile / 100.0 * total));
+    uint64_t seen = 0;
+    for (int i = 0; i < bucketCount; i++)
+    {
+      seen += getBucket(i);
+      if (seen > rank)
+        return bucketUpperBoundUs(i);
+    }
+    return bucketUpperBoundUs(bucketCount - 1);
+  }
+};
@@ -0,0 +1,319 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./include/crow_all.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  constexpr size_t ringCapacity = 256;
+  constexpr size_t maxMessage = 232;
+  constexpr auto drainInterval = milliseconds(20);
+
+  struct LogRecord
+  {
+    int64_t timeUs;
+    uint64_t suppressed;
+    long thread;
+    LogLevel level;
+    uint16_t length;
+    char text[maxMessage];
+  };
+
+  // Single-producer (the owning thread), single-consumer (the drain thread).
+  struct LogRing
+  {
+    LogRecord slots[ringCapacity];
+    alignas(64) atomic<uint64_t> head{0};
+    alignas(64) atomic<uint64_t> tail{0};
+    atomic<uint64_t> dropped{0};
+    atomic<bool> closed{false};
+    long thread = 0;
+  };
+
+  // Never destroyed, so threads still logging during static destruction
+  // don't touch a dead registry.
+  struct LoggerState
+  {
+    atomic<int> minLevel{(int)LogLevel::Info};
+    bool json = false;
+    mutex ringsMutex;
+    vector<shared_ptr<LogRing>> rings;
+    mutex drainMutex;
+    once_flag started;
+  };
+
+  LoggerState &state()
+  {
+    static LoggerState *instance = new LoggerState;
+    return *instance;
+  }
+
+  // Marks the ring closed when its thread exits; the drain thread frees it
+  // once its remaining records are written.
+  struct ThreadLog
+  {
+    shared_ptr<LogRing> ring;
+
+    ~ThreadLog()
+    {
+      if (ring)
+        ring->closed = true;
+    }
+  };
+
+  LogRing &threadRing()
+  {
+    thread_local ThreadLog log;
+    if (!log.ring)
+    {
+      log.ring = make_shared<LogRing>();
+      log.ring->thread = syscall(SYS_gettid);
+      lock_guard<mutex> lock(state().ringsMutex);
+      state().rings.push_back(log.ring);
+    }
+    return *log.ring;
+  }
+
+  const char *levelName(LogLevel level)
+  {
+    switch (level)
+    {
+    case LogLevel::Debug:
+      return "debug";
+    case LogLevel::Info:
+      return "info";
+    case LogLevel::Warning:
+      return "warning";
+    case LogLevel::Error:
+      return "error";
+    }
+    return "unknown";
+  }
+
+  void appendTimestamp(string &out, int64_t timeUs)
+  {
+    time_t seconds = timeUs / 1000000;
+    tm utc;
+    gmtime_r(&seconds, &utc);
+    char text[40];
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(text + length, sizeof(text) - length, ".%06lldZ", (long long)(timeUs % 1000000));
+    out += text;
+  }
+
+  void appendJsonString(string &out, const char *text, size_t length)
+  {
+    out += '"';
+    for (size_t i = 0; i < length; i++)
+    {
+      char c = text[i];
+      if (c == '"' || c == '\\')
+      {
+        out += '\\';
+        out += c;
+      }
+      else if ((unsigned char)c < 0x20)
+      {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+      }
+      else
+      {
+        out += c;
+      }
+    }
+    out += '"';
+  }
+
+  void appendRecord(string &out, const LogRecord &record, bool json)
+  {
+    if (json)
+    {
+      out += "{\"time\":\"";
+      appendTimestamp(out, record.timeUs);
+      out += "\",\"level\":\"";
+      out += levelName(record.level);
+      out += "\",\"thread\":" + to_string(record.thread) + ",\"message\":";
+      appendJsonString(out, record.text, record.length);
+      if (record.suppressed)
+        out += ",\"suppressed\":" + to_string(record.suppressed);
+      out += "}\n";
+      return;
+    }
+
+    appendTimestamp(out, record.timeUs);
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), " %-7s [%ld] ", levelName(record.level), record.thread);
+    out += prefix;
+    out.append(record.text, record.length);
+    if (record.suppressed)
+      out += " (" + to_string(record.suppressed) + " similar suppressed)";
+    out += '\n';
+  }
+
+  int64_t nowUs()
+  {
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  }
+
+  void drain()
+  {
+    LoggerState &logger = state();
+    lock_guard<mutex> drainLock(logger.drainMutex);
+
+    vector<shared_ptr<LogRing>> rings;
+    {
+      lock_guard<mutex> lock(logger.ringsMutex);
+      rings = logger.rings;
+    }
+
+    vector<LogRecord> batch;
+    for (auto &ring : rings)
+    {
+      uint64_t head = ring->head.load(memory_order_relaxed);
+      uint64_t tail = ring->tail.load(memory_order_acquire);
+      for (; head < tail; head++)
+      {
+        batch.push_back(ring->slots[head % ringCapacity]);
+      }
+      ring->head.store(head, memory_order_release);
+
+      if (uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed))
+      {
+        LogRecord note{nowUs(), 0, ring->thread, LogLevel::Warning, 0, {}};
+        note.length = snprintf(note.text, maxMessage, "Dropped %llu log messages (buffer full)", (unsigned long long)dropped);
+        batch.push_back(note);
+      }
+    }
+
+    if (!batch.empty())
+    {
+      // Rings are drained one after another; restore the global order.
+      stable_sort(batch.begin(), batch.end(), [](const LogRecord &a, const LogRecord &b)
+                  { return a.timeUs < b.timeUs; });
+      string out;
+      out.reserve(batch.size() * 96);
+      for (auto &record : batch)
+      {
+        appendRecord(out, record, logger.json);
+      }
+      fwrite(out.data(), 1, out.size(), stderr);
+      fflush(stderr);
+    }
+
+    lock_guard<mutex> lock(logger.ringsMutex);
+    logger.rings.erase(remove_if(logger.rings.begin(), logger.rings.end(), [](const shared_ptr<LogRing> &ring)
+                                 { return ring->closed && ring->head.load() == ring->tail.load(); }),
+                       logger.rings.end());
+  }
+
+  class CrowLogHandler : public crow::ILogHandler
+  {
+  public:
+    void log(string message, crow::LogLevel level) override
+    {
+      LogLevel mapped = level == crow::LogLevel::Debug     ? LogLevel::Debug
+                        : level == crow::LogLevel::Info    ? LogLevel::Info
+                        : level == crow::LogLevel::Warning ? LogLevel::Warning
+                                                           : LogLevel::Error;
+      if (logEnabled(mapped))
+        logWrite(mapped, 0, "%s", message.c_str());
+    }
+  };
+
+  LogLevel parseLevel(const char *value)
+  {
+    string level = value ? value : "info";
+    if (level == "debug")
+      return LogLevel::Debug;
+    if (level == "warning")
+      return LogLevel::Warning;
+    if (level == "error")
+      return LogLevel::Error;
+    return LogLevel::Info;
+  }
+
+  void start()
+  {
+    LoggerState &logger = state();
+    LogLevel level = parseLevel(getenv("LOG_LEVEL"));
+    const char *format = getenv("LOG_FORMAT");
+    logger.json = format && string(format) == "json";
+    logger.minLevel = (int)level;
+
+    static CrowLogHandler crowHandler;
+    crow::logger::setHandler(&crowHandler);
+    crow::logger::setLogLevel(level == LogLevel::Debug     ? crow::LogLevel::Debug
+                              : level == LogLevel::Info    ? crow::LogLevel::Info
+                              : level == LogLevel::Warning ? crow::LogLevel::Warning
+                                                           : crow::LogLevel::Error);
+
+    thread([]
+           {
+      while (true)
+      {
+        this_thread::sleep_for(drainInterval);
+        drain();
+      } })
+        .detach();
+    atexit(flushLogs);
+  }
+}
+
+void initLogging()
+{
+  call_once(state().started, start);
+}
+
+void flushLogs()
+{
+  drain();
+}
+
+bool logEnabled(LogLevel level)
+{
+  return (int)level >= state().minLevel.load(memory_order_relaxed);
+}
+
+void logWrite(LogLevel level, uint64_t suppressed, const char *format, ...)
+{
+  initLogging();
+  LogRing &ring = threadRing();
+
+  uint64_t tail = ring.tail.load(memory_order_relaxed);
+  if (tail - ring.head.load(memory_order_acquire) >= ringCapacity)
+  {
+    ring.dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+
+  LogRecord &record = ring.slots[tail % ringCapacity];
+  record.timeUs = nowUs();
+  record.suppressed = suppressed;
+  record.thread = ring.thread;
+  record.level = level;
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(record.text, maxMessage, format, args);
+  va_end(args);
+  record.length = (uint16_t)min<size_t>(max(length, 0), maxMessage - 1);
+
+  ring.tail.store(tail + 1, memory_order_release);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+enum class LogLevel
+{
+  Debug,
+  Info,
+  Warning,
+  Error,
+};
+
+// Asynchronous logger. Each thread formats its message into a slot of its own
+// lock-free ring buffer; a background thread drains all rings, orders the
+// records by time and writes them to stderr in batches. Logging never takes a
+// lock or touches stdio on the calling thread, and when a ring is full the
+// message is dropped (and counted) rather than blocking a capture or viewer.
+//
+// LOG_LEVEL (debug, info, warning, error) sets the minimum level and
+// LOG_FORMAT=json switches from text lines to one JSON object per line.
+// Crow's own log output is routed through the same rings.
+void initLogging();
+// Writes out everything logged so far; called at exit automatically.
+void flushLogs();
+
+bool logEnabled(LogLevel level);
+void logWrite(LogLevel level, uint64_t suppressed, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// Lets at most `perSecond` messages per second through one call site and
+// counts the rest, so a condition that repeats every frame (a camera that
+// keeps returning empty reads) can't flood the log.
+class LogRateLimiter
+{
+private:
+  int perSecond;
+  std::atomic<int64_t> windowStart{0};
+  std::atomic<int> inWindow{0};
+  std::atomic<uint64_t> suppressed{0};
+
+public:
+  explicit LogRateLimiter(int perSecond) : perSecond(perSecond) {}
+
+  // True if the message should be written; `suppressedSince` is set to the
+  // number of messages dropped since the last one that was.
+  bool allow(uint64_t &suppressedSince)
+  {
+    int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+                         std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+    int64_t start = windowStart.load(std::memory_order_relaxed);
+    if (second != start && windowStart.compare_exchange_strong(start, second, std::memory_order_relaxed))
+    {
+      inWindow.store(0, std::memory_order_relaxed);
+    }
+    if (inWindow.fetch_add(1, std::memory_order_relaxed) >= perSecond)
+    {
+      suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    suppressedSince = suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+};
+
+#define LOG_AT(level, ...)                \
+  do                                      \
+  {                                       \
+    if (logEnabled(level))                \
+      logWrite(level, 0, __VA_ARGS__);    \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LogLevel::Warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::Error, __VA_ARGS__)
+
+#define LOG_RATE_LIMITED(level, perSecond, ...)           \
+  do                                                      \
+  {                                                       \
+    static LogRateLimiter logLimiter_(perSecond);         \
+    uint64_t logSuppressed_ = 0;                          \
+    if (logEnabled(level) && logLimiter_.allow(logSuppressed_)) \
+      logWrite(level, logSuppressed_, __VA_ARGS__);       \
+  } while (0)
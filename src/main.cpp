@@ -1,5 +1,4 @@
 #include <opencv2/opencv.hpp>
-#include <iostream>
 #include <vector>
 #include <thread>
 #include <mutex>
@@ -8,200 +7,831 @@
 #include <chrono>
 #include <map>
 #include <memory>
+#include <functional>
+#include <cstdlib>
+#include <array>
+#include <algorithm>
+#include <cctype>
+#include <sstream>
 #include "./include/crow_all.h"
+#include "camera.h"
+#include "camera_store.h"
+#include "capture.h"
+#include "encoder.h"
+#include "events.h"
+#include "frame_fanout.h"
+#include "http_server.h"
+#include "logger.h"
+#include "metrics.h"
+#include "motion.h"
+#include "multipart.h"
+#include "playback.h"
+#include "prebuffer.h"
+#include "recorder.h"
+#include "retention.h"
+#include "thumbnails.h"
+#include "thread_tuning.h"
+#include "trace.h"
+#include "virtual_sources.h"
+#include "ws_stream.h"
 
 using namespace cv;
 using namespace std;
 using namespace boost::asio;
 using namespace std::chrono;
 
-struct CameraConfig
+// Tracks cameras brought back from the store until each has either produced
+// its first frame or failed to open, so the warm-restart time can be reported.
+struct RestoreProgress
 {
-  string url;
-  int frameRate;
-  bool active;
-  Mat currentFrame;
-  mutex frameMutex;
-  condition_variable frameAvailable;
+  mutex progressMutex;
+  condition_variable done;
+  size_t remaining;
+  size_t live = 0;
+
+  explicit RestoreProgress(size_t count) : remaining(count) {}
+
+  void finish(bool isLive)
+  {
+    {
+      lock_guard<mutex> lock(progressMutex);
+      remaining--;
+      if (isLive)
+        live++;
+    }
+    done.notify_all();
+  }
 };
 
 class CameraService
 {
 private:
   map<int, shared_ptr<CameraConfig>> cameras;
-  map<int, unique_ptr<VideoCapture>> captures;
-  map<int, thread> captureThreads;
+  mutex camerasMutex;
   atomic<int> nextCameraId{1};
+  CameraStore &store;
+  mutex storeMutex;
+  // Cleared when the stored registry couldn't be read, so this run never
+  // replaces it with a registry that lacks its cameras. Guarded by storeMutex.
+  bool storeWritable = true;
+
+  // Declared before the encoder so they outlive the encoder threads that feed them.
+  RecordingEngine recorder;
+  RetentionManager retention;
+  PreEventBuffer preEventBuffer;
+  WebSocketStreamHub webStreams;
+  FrameFanout fanout;
+  JpegEncoderPool encoder;
+  ThumbnailTimeline thumbnails;
+  // Before the motion detector, whose workers publish into it.
+  EventHub events;
+  MotionDetector motion;
+  vector<CapturedFrameListener *> captureListeners;
+  unique_ptr<CaptureWorkerPool> capturePool;
+
+  void startCapture(shared_ptr<CaptureSession> session, milliseconds delay)
+  {
+    if (capturePool)
+    {
+      capturePool->submit(move(session), steady_clock::now() + delay);
+      return;
+    }
+
+    thread([session, delay]
+           {
+      this_thread::sleep_for(delay);
+      session->run(); })
+        .detach();
+  }
 
-  void captureFramesFromCamera(int cameraId, shared_ptr<CameraConfig> config)
+  shared_ptr<CameraConfig> registerCamera(const StoredCamera &settings)
   {
-    auto &cap = captures[cameraId];
-    while (config->active)
+    auto config = make_shared<CameraConfig>();
+    config->id = settings.id;
+    config->url = settings.url;
+    config->frameRate = settings.frameRate;
+    config->record = settings.record;
+    config->preEventSeconds = settings.preEventSeconds;
+    config->motionFps = settings.motionFps;
+    config->active = true;
+    motion.startCamera(config);
+
+    lock_guard<mutex> lock(camerasMutex);
+    cameras[settings.id] = config;
+    return config;
+  }
+
+  void startStorage(const shared_ptr<CameraConfig> &config)
+  {
+    if (config->record)
+    {
+      recorder.startRecording(config, encoder);
+      thumbnails.startCamera(config);
+    }
+    if (config->preEventSeconds > 0)
     {
-      Mat frame;
-      cap->read(frame);
+      preEventBuffer.startBuffering(config, seconds(config->preEventSeconds), encoder);
+    }
+  }
 
-      if (frame.empty())
-      {
-        cerr << "Error: Empty frame from camera " << cameraId << endl;
-        continue;
-      }
+  // Snapshot and write happen under one lock so concurrent add/remove calls
+  // can never leave an older registry on disk than the one in memory.
+  void persist()
+  {
+    lock_guard<mutex> storeLock(storeMutex);
+    if (!storeWritable)
+    {
+      LOG_WARNING("Not saving cameras to %s: the stored registry was unreadable", store.getPath().c_str());
+      return;
+    }
 
+    CameraRegistrySnapshot snapshot;
+    {
+      lock_guard<mutex> lock(camerasMutex);
+      snapshot.nextCameraId = nextCameraId;
+      for (auto &[id, config] : cameras)
       {
-        lock_guard<mutex> lock(config->frameMutex);
-        frame.copyTo(config->currentFrame);
+        snapshot.cameras.push_back(
+            {id, config->url, config->frameRate, config->record, config->preEventSeconds, config->motionFps});
       }
-      config->frameAvailable.notify_all();
-      this_thread::sleep_for(milliseconds(1000 / config->frameRate));
+    }
+
+    try
+    {
+      store.save(snapshot);
+    }
+    catch (exception &e)
+    {
+      LOG_ERROR("%s", e.what());
     }
   }
 
 public:
-  int addCamera(const string &url, int frameRate)
+  // With captureWorkers == 0 every camera gets a dedicated capture thread;
+  // otherwise all cameras share a pool of that many threads.
+  CameraService(CameraStore &store, size_t captureWorkers, size_t encoderThreads, int jpegQuality,
+                const string &recordingsDir, seconds segmentDuration, size_t preEventBytesPerCamera,
+                size_t preEventTotalBytes, RetentionLimits retentionLimits, seconds thumbnailInterval,
+                int thumbnailWidth, size_t motionThreads, milliseconds eventBatchInterval)
+      : store(store), recorder(recordingsDir, segmentDuration, 256 << 20), retention(recorder, retentionLimits),
+        preEventBuffer(preEventBytesPerCamera, preEventTotalBytes), webStreams([this](int id)
+                                                          { return getCamera(id); },
+                                                          encoder),
+        encoder(encoderThreads, jpegQuality), thumbnails(recorder, thumbnailInterval, thumbnailWidth, 70),
+        events([this]
+               { return listCameras(); },
+               eventBatchInterval),
+        motion(motionThreads)
   {
-    int id = nextCameraId++;
+    motion.setChangeHandler([this](int id, const MotionState &state)
+                            { events.motionChanged(id, state); });
+    captureListeners.push_back(&thumbnails);
+    captureListeners.push_back(&motion);
+    encoder.addListener(&recorder);
+    encoder.addListener(&preEventBuffer);
+    encoder.addListener(&webStreams);
+    encoder.addListener(&fanout);
+    if (captureWorkers > 0)
+    {
+      capturePool = make_unique<CaptureWorkerPool>(captureWorkers, 2);
+      LOG_INFO("Capturing on a pool of %zu threads", captureWorkers);
+    }
+  }
 
-    auto cap = make_unique<VideoCapture>(url);
+  // `settings.id` is ignored; the new camera's id is returned.
+  int addCamera(StoredCamera settings)
+  {
+    auto cap = CaptureSession::openCapture(settings.url);
     if (!cap->isOpened())
     {
-      throw runtime_error("Failed to open camera: " + url);
+      throw runtime_error("Failed to open camera: " + settings.url);
     }
 
-    auto config = make_shared<CameraConfig>();
-    config->url = url;
-    config->frameRate = frameRate;
-    config->active = true;
-
-    cameras[id] = config;
-    captures[id] = move(cap);
-
-    captureThreads[id] = thread(&CameraService::captureFramesFromCamera, this, id, config);
-    captureThreads[id].detach();
+    int id = settings.id = nextCameraId++;
+    auto config = registerCamera(settings);
+    startCapture(make_shared<CaptureSession>(id, config, move(cap), &encoder, captureListeners), milliseconds(0));
+    startStorage(config);
 
+    persist();
     return id;
   }
 
   void removeCamera(int id)
   {
-    if (cameras.find(id) != cameras.end())
     {
-      cameras[id]->active = false;
-      captures.erase(id);
-      cameras.erase(id);
+      lock_guard<mutex> lock(camerasMutex);
+      auto it = cameras.find(id);
+      if (it == cameras.end())
+      {
+        return;
+      }
+      it->second->active = false;
+      it->second->frameAvailable.notify_all();
+      cameras.erase(it);
+    }
+    recorder.stopRecording(id);
+    thumbnails.stopCamera(id);
+    motion.stopCamera(id);
+    preEventBuffer.stopBuffering(id);
+    persist();
+  }
+
+  JpegEncoderPool &getEncoder() { return encoder; }
+  RecordingEngine &getRecorder() { return recorder; }
+  RetentionManager &getRetention() { return retention; }
+  ThumbnailTimeline &getThumbnails() { return thumbnails; }
+  MotionDetector &getMotion() { return motion; }
+  EventHub &getEvents() { return events; }
+  WebSocketStreamHub &getWebStreams() { return webStreams; }
+  FrameFanout &getFanout() { return fanout; }
+
+  // Changes how often the camera is analysed for motion; 0 turns it off.
+  bool setMotionFps(int id, int fps)
+  {
+    auto camera = getCamera(id);
+    if (!camera)
+    {
+      return false;
+    }
+    camera->motionFps = fps;
+    persist();
+    return true;
+  }
+
+  // Flushes the camera's pre-event buffer into a clip that continues with
+  // live frames for `postEvent`. Returns the clip path and frames written
+  // from before the trigger, or an empty path for an unknown camera.
+  pair<string, size_t> createClip(int id, seconds postEvent)
+  {
+    auto camera = getCamera(id);
+    if (!camera)
+    {
+      return {"", 0};
     }
+    auto preEvent = preEventBuffer.snapshot(id);
+    return {recorder.startClip(camera, preEvent, postEvent, encoder), preEvent.size()};
   }
 
   shared_ptr<CameraConfig> getCamera(int id)
   {
-    if (cameras.find(id) != cameras.end())
+    lock_guard<mutex> lock(camerasMutex);
+    auto it = cameras.find(id);
+    if (it != cameras.end())
     {
-      return cameras[id];
+      return it->second;
     }
     return nullptr;
   }
+
+  vector<pair<int, shared_ptr<CameraConfig>>> listCameras()
+  {
+    lock_guard<mutex> lock(camerasMutex);
+    return {cameras.begin(), cameras.end()};
+  }
+
+  // Re-registers every stored camera immediately (so stream requests are
+  // accepted right away) and opens them in parallel, starting one every
+  // `stagger` so a restart doesn't hit the NVR or network with every RTSP
+  // handshake at once. Returns without waiting for the cameras to connect.
+  void restoreCameras(milliseconds stagger)
+  {
+    auto started = steady_clock::now();
+
+    // Ids with recordings on disk stay taken even if the registry lost them,
+    // so a new camera never inherits another one's footage.
+    for (auto &[id, bytes] : recorder.getCameraUsage())
+    {
+      nextCameraId = max(nextCameraId.load(), id + 1);
+    }
+
+    CameraRegistrySnapshot snapshot;
+    try
+    {
+      snapshot = store.load();
+    }
+    catch (exception &e)
+    {
+      lock_guard<mutex> storeLock(storeMutex);
+      storeWritable = false;
+      string movedTo = store.setAside();
+      LOG_ERROR("%s; %s. Cameras added until it is repaired and the service restarted are not saved", e.what(),
+                movedTo.empty() ? "left in place" : ("moved to " + movedTo).c_str());
+      return;
+    }
+
+    nextCameraId = max(nextCameraId.load(), snapshot.nextCameraId);
+    if (snapshot.cameras.empty())
+    {
+      return;
+    }
+
+    size_t total = snapshot.cameras.size();
+    auto progress = make_shared<RestoreProgress>(total);
+    LOG_INFO("Restoring %zu cameras from %s", total, store.getPath().c_str());
+
+    for (size_t i = 0; i < total; i++)
+    {
+      const StoredCamera &stored = snapshot.cameras[i];
+      auto config = registerCamera(stored);
+      auto session = make_shared<CaptureSession>(stored.id, config, nullptr, &encoder, captureListeners,
+                                                 [progress](bool live)
+                                                 { progress->finish(live); });
+      startCapture(move(session), duration_cast<milliseconds>(stagger * i));
+      startStorage(config);
+    }
+
+    thread([progress, started, total]
+           {
+      unique_lock<mutex> lock(progress->progressMutex);
+      bool complete = progress->done.wait_for(lock, seconds(60), [&]
+                                              { return progress->remaining == 0; });
+      auto elapsed = duration_cast<milliseconds>(steady_clock::now() - started).count();
+      LOG_INFO("Restored %zu/%zu cameras in %lld ms%s", progress->live, total, (long long)elapsed,
+               complete ? "" : " (timed out waiting for the rest)"); })
+        .detach();
+  }
 };
 
-void handleClient(ip::tcp::socket socket, shared_ptr<CameraConfig> camera, int cameraId)
+// Shown to viewers while a camera has no live picture, so the MJPEG stream
+// keeps delivering parts (and the browser keeps the connection) instead of
+// stalling until the camera comes back.
+vector<uchar> renderPlaceholder(int cameraId, CameraHealth health)
 {
+  Mat image(360, 640, CV_8UC3, Scalar(40, 40, 40));
+  string text = "Camera " + to_string(cameraId) + ": " + healthName(health);
+  putText(image, text, Point(40, 190), FONT_HERSHEY_SIMPLEX, 1.2, Scalar(220, 220, 220), 2, LINE_AA);
+
+  vector<uchar> jpeg;
+  imencode(".jpg", image, jpeg);
+  return jpeg;
+}
+
+// Returns the number of bytes written.
+size_t sendFramePart(ip::tcp::socket &socket, const vector<uchar> &jpeg, const FrameInfo *info = nullptr)
+{
+  string headers = framePartHeaders(jpeg.size(), info);
+  array<const_buffer, 3> part = {buffer(headers), buffer(jpeg), buffer("\r\n", 2)};
+  return write(socket, part);
+}
+
+size_t sendSnapshot(ip::tcp::socket &socket, const vector<uchar> &jpeg)
+{
+  string headers = "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: " + to_string(jpeg.size()) +
+                   "\r\nCache-Control: no-store\r\nConnection: close\r\n\r\n";
+  array<const_buffer, 2> response = {buffer(headers), buffer(jpeg)};
+  return write(socket, response);
+}
+
+// Counts a viewer in the camera's metrics for as long as it is connected.
+struct ViewerGauge
+{
+  atomic<int> &viewers;
+
+  explicit ViewerGauge(atomic<int> &viewers) : viewers(viewers) { viewers++; }
+  ~ViewerGauge() { viewers--; }
+};
+
+// Sends the camera as MJPEG, or with `snapshot` a single JPEG, in the
+// rendition `key` asks for, at most `fps` frames a second.
+void handleClient(ip::tcp::socket socket, shared_ptr<CameraConfig> camera, int cameraId, JpegEncoderPool &encoder,
+                  RenditionKey key, int fps, bool snapshot)
+{
+  // Viewer threads only wait and send; the JPEG is encoded once per frame by
+  // the encoder pool and shared between all viewers of the camera.
+  applyThreadTuning(ThreadRole::Network);
+  setTraceThreadName("viewer-" + to_string(cameraId), TraceRingSize::Connection);
   string clientAddress = socket.remote_endpoint().address().to_string();
-  cout << "Client connected to camera " << cameraId << " from " << clientAddress << endl;
+  LOG_INFO("Client connected to camera %d from %s", cameraId, clientAddress.c_str());
 
   try
   {
-    string header = "HTTP/1.1 200 OK\r\n"
-                    "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
-    socket.send(buffer(header));
+    if (!snapshot)
+    {
+      string header = "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+      socket.send(buffer(header));
+    }
 
-    vector<uchar> buf;
-    vector<int> params = {IMWRITE_JPEG_QUALITY, 90};
+    JpegSubscription subscription(encoder, camera, key);
+    ViewerGauge viewer(camera->metrics.viewers);
+    FrameRateLimiter limiter(snapshot ? 0 : fps);
+    uint64_t nextSeq = subscription.minSeq();
+    uint64_t lastPublishedSeq = 0;
+    vector<uchar> placeholder;
+    CameraHealth placeholderHealth = CameraHealth::Live;
 
     while (camera->active)
     {
-      Mat frame;
+      shared_ptr<const EncodedFrame> frame;
+      CameraHealth health;
       {
         unique_lock<mutex> lock(camera->frameMutex);
-        camera->frameAvailable.wait(lock, [&]
-                                    { return !camera->currentFrame.empty(); });
-        camera->currentFrame.copyTo(frame);
+        auto hasNewFrame = [&]
+        {
+          auto &latest = subscription.latest();
+          return camera->health == CameraHealth::Live && latest && latest->info.seq >= nextSeq &&
+                 limiter.due(latest->info.captureTimeUs);
+        };
+        camera->frameAvailable.wait_for(lock, seconds(1), [&]
+                                        { return !camera->active || hasNewFrame(); });
+        health = camera->health;
+        if (hasNewFrame())
+        {
+          frame = subscription.latest();
+        }
       }
 
-      imencode(".jpg", frame, buf, params);
-      string boundary = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + to_string(buf.size()) + "\r\n\r\n";
-      socket.send(buffer(boundary));
-      socket.send(buffer(reinterpret_cast<const char *>(buf.data()), buf.size()));
-      socket.send(buffer("\r\n"));
+      if (!frame)
+      {
+        if (!camera->active)
+        {
+          break;
+        }
+        if (health == CameraHealth::Live)
+        {
+          // Live but no new frame within a second; keep waiting.
+          continue;
+        }
+        if (placeholder.empty() || placeholderHealth != health)
+        {
+          placeholder = renderPlaceholder(cameraId, health);
+          placeholderHealth = health;
+        }
+        if (snapshot)
+        {
+          sendSnapshot(socket, placeholder);
+          break;
+        }
+        sendFramePart(socket, placeholder);
+        continue;
+      }
 
-      this_thread::sleep_for(milliseconds(33));
+      // A viewer with its own frame rate skips frames on purpose.
+      if (!limiter.limited() && lastPublishedSeq > 0 && frame->publishedSeq > lastPublishedSeq + 1)
+      {
+        // Frames published while this viewer was still sending the last one.
+        camera->metrics.sendDropped.add(frame->publishedSeq - lastPublishedSeq - 1);
+      }
+      lastPublishedSeq = frame->publishedSeq;
+      {
+        TraceSpan span("send", cameraId);
+        camera->metrics.bytesSent.add(snapshot ? sendSnapshot(socket, frame->jpeg)
+                                               : sendFramePart(socket, frame->jpeg, &frame->info));
+      }
+      camera->metrics.framesSent.add();
+      camera->latency.captureToSend.record(steady_clock::now() - frame->info.capturedAt);
+      nextSeq = frame->info.seq + 1;
+      limiter.sent(frame->info.captureTimeUs);
+      if (snapshot)
+        break;
     }
   }
   catch (exception &e)
   {
-    cerr << "Client " << clientAddress << " disconnected from camera " << cameraId << ": " << e.what() << endl;
+    LOG_INFO("Client %s disconnected from camera %d: %s", clientAddress.c_str(), cameraId, e.what());
   }
 }
 
-void streamServer(CameraService &service)
+// Serves several cameras on one connection as multipart/mixed, each part
+// tagged with X-Camera-Id. Every camera goes out at its own rate; the parts
+// of all cameras that published during the previous write leave in a
+// single write.
+void handleMuxClient(ip::tcp::socket socket, vector<shared_ptr<CameraConfig>> cameras, JpegEncoderPool &encoder,
+                     FrameFanout &fanout, int fps)
 {
+  applyThreadTuning(ThreadRole::Network);
+  setTraceThreadName("viewer-mux", TraceRingSize::Connection);
+  string clientAddress = socket.remote_endpoint().address().to_string();
+  LOG_INFO("Client connected to %zu cameras from %s", cameras.size(), clientAddress.c_str());
+
+  struct Viewed
+  {
+    shared_ptr<CameraConfig> camera;
+    JpegSubscription subscription;
+    ViewerGauge viewer;
+    FrameRateLimiter limiter;
+    uint64_t nextSeq;
+    uint64_t lastPublishedSeq = 0;
+
+    Viewed(JpegEncoderPool &encoder, shared_ptr<CameraConfig> camera, int fps)
+        : camera(camera), subscription(encoder, camera), viewer(camera->metrics.viewers), limiter(fps),
+          nextSeq(subscription.minSeq())
+    {
+    }
+  };
+
+  FrameMailbox mailbox;
+  vector<int> ids;
+  for (auto &camera : cameras)
+  {
+    ids.push_back(camera->id);
+  }
+  // Registered before subscribing so the frame each subscription requests
+  // isn't missed.
+  fanout.add(&mailbox, ids);
   try
   {
-    io_service io_service;
-    ip::tcp::acceptor acceptor(io_service, ip::tcp::endpoint(ip::tcp::v4(), 3000));
-    cout << "Stream server started on port 3000" << endl;
+    string header = "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: multipart/mixed; boundary=frame\r\n\r\n";
+    socket.send(buffer(header));
+
+    map<int, unique_ptr<Viewed>> viewed;
+    for (auto &camera : cameras)
+    {
+      viewed[camera->id] = make_unique<Viewed>(encoder, camera, fps < camera->frameRate ? fps : 0);
+    }
 
-    while (true)
+    vector<string> headers;
+    vector<const_buffer> parts;
+    vector<tuple<CameraConfig *, const EncodedFrame *, size_t>> sent;
+    while (any_of(cameras.begin(), cameras.end(), [](auto &camera)
+                  { return camera->active.load(); }))
     {
-      ip::tcp::socket socket(io_service);
-      acceptor.accept(socket);
+      auto frames = mailbox.take(seconds(1));
+      headers.clear();
+      parts.clear();
+      sent.clear();
+      headers.reserve(frames.size());
+      for (auto &[id, frame] : frames)
+      {
+        Viewed &view = *viewed[id];
+        if (frame->info.seq < view.nextSeq || !view.limiter.due(frame->info.captureTimeUs))
+          continue;
+        if (!view.limiter.limited() && view.lastPublishedSeq > 0 && frame->publishedSeq > view.lastPublishedSeq + 1)
+        {
+          view.camera->metrics.sendDropped.add(frame->publishedSeq - view.lastPublishedSeq - 1);
+        }
+        view.nextSeq = frame->info.seq + 1;
+        view.lastPublishedSeq = frame->publishedSeq;
+        view.limiter.sent(frame->info.captureTimeUs);
+        headers.push_back(framePartHeaders(frame->jpeg.size(), &frame->info, id));
+        parts.push_back(buffer(headers.back()));
+        parts.push_back(buffer(frame->jpeg));
+        parts.push_back(buffer("\r\n", 2));
+        sent.emplace_back(view.camera.get(), frame.get(), headers.back().size() + frame->jpeg.size() + 2);
+      }
+      if (parts.empty())
+        continue;
 
-      // Read HTTP request
-      char request[1024] = {0};
-      size_t len = socket.receive(buffer(request));
-      string req(request, len);
+      {
+        TraceSpan span("send-mux");
+        write(socket, parts);
+      }
+      auto now = steady_clock::now();
+      for (auto &[camera, frame, bytes] : sent)
+      {
+        camera->metrics.framesSent.add();
+        camera->metrics.bytesSent.add(bytes);
+        camera->latency.captureToSend.record(now - frame->info.capturedAt);
+      }
+    }
+  }
+  catch (exception &e)
+  {
+    LOG_INFO("Client %s disconnected from %zu cameras: %s", clientAddress.c_str(), cameras.size(), e.what());
+  }
+  fanout.remove(&mailbox);
+}
+
+void handlePlayback(ip::tcp::socket socket, RecordingEngine &recorder, int cameraId, int64_t fromUs, double speed)
+{
+  applyThreadTuning(ThreadRole::Network);
+  setTraceThreadName("playback-" + to_string(cameraId), TraceRingSize::Connection);
+  if (!streamPlayback(socket.native_handle(), recorder, cameraId, fromUs, speed))
+  {
+    string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    boost::system::error_code error;
+    write(socket, buffer(response), error);
+  }
+}
 
-      cout << "Received request: " << req << endl;
+// Sends the thumbnails of [fromUs, toUs] as one multipart/mixed response.
+// Reading a range can touch many packs, so this runs on a thread of its own
+// rather than on an event loop.
+void handleThumbnails(ip::tcp::socket socket, ThumbnailTimeline &thumbnails, int cameraId, int64_t fromUs,
+                      int64_t toUs, size_t limit)
+{
+  setTraceThreadName("thumbnails-" + to_string(cameraId), TraceRingSize::Connection);
+  ThumbnailBatch batch = thumbnails.read(cameraId, fromUs, toUs, limit);
+  string body;
+  body.reserve(batch.data.size() + batch.entries.size() * 128);
+  FrameInfo info;
+  for (auto &entry : batch.entries)
+  {
+    info.seq++;
+    info.captureTimeUs = entry.timeUs;
+    body += framePartHeaders(entry.size, &info);
+    body.append(batch.data, entry.offset, entry.size);
+    body += "\r\n";
+  }
+  body += "--frame--\r\n";
+
+  string headers = "HTTP/1.1 200 OK\r\nContent-Type: multipart/mixed; boundary=frame\r\nX-Thumbnail-Count: " +
+                   to_string(batch.entries.size()) + "\r\nContent-Length: " + to_string(body.size()) +
+                   "\r\nConnection: close\r\n\r\n";
+  array<const_buffer, 2> response = {buffer(headers), buffer(body)};
+  boost::system::error_code error;
+  write(socket, response, error);
+}
+
+// One trace capture at a time; a second request gets 409 instead of
+// queueing behind the first.
+atomic<bool> traceCaptureRunning{false};
 
-      // Parse request path
-      size_t pathStart = req.find(" ") + 1;
-      size_t pathEnd = req.find(" ", pathStart);
-      string path = req.substr(pathStart, pathEnd - pathStart);
+// Records pipeline spans for `duration` and sends them as Chrome trace JSON.
+// Runs on a thread of its own, as the capture waits out the whole window.
+void handleTrace(ip::tcp::socket socket, milliseconds duration)
+{
+  setTraceThreadName("trace", TraceRingSize::Connection);
+  string trace = captureTrace(duration);
+  traceCaptureRunning = false;
+  string headers = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                   "Content-Disposition: attachment; filename=\"trace.json\"\r\nContent-Length: " +
+                   to_string(trace.size()) + "\r\nConnection: close\r\n\r\n";
+  array<const_buffer, 2> response = {buffer(headers), buffer(trace)};
+  boost::system::error_code error;
+  write(socket, response, error);
+}
 
-      cout << "Path: " << path << endl;
+// Serves the stream URLs, the thumbnail timeline and the trace capture on a
+// connection of their own; anything else is left to the REST routes.
+bool serveStream(CameraService &service, ip::tcp::socket &socket, const crow::request &request)
+{
+  if (request.method != crow::HTTPMethod::Get)
+    return false;
 
-      try
+  const string &path = request.url;
+  try
+  {
+    // /mux?cameras=1,2,3&fps=2
+    if (path == "/mux")
+    {
+      const char *list = request.url_params.get("cameras");
+      const char *fps = request.url_params.get("fps");
+      vector<shared_ptr<CameraConfig>> cameras;
+      stringstream ids(list ? list : "");
+      string id;
+      while (getline(ids, id, ','))
       {
-        size_t lastSlash = path.find_last_of('/');
-        if (lastSlash != string::npos)
+        auto camera = service.getCamera(stoi(id));
+        if (!camera)
         {
-          int cameraId = stoi(path.substr(lastSlash + 1));
-          cout << "Camera ID: " << cameraId << endl;
-
-          auto camera = service.getCamera(cameraId);
-          if (camera)
-          {
-            thread(handleClient, move(socket), camera, cameraId).detach();
-          }
-          else
-          {
-            cout << "Camera " << cameraId << " not found" << endl;
-          }
+          LOG_WARNING("Camera %s not found", id.c_str());
+          return false;
         }
+        if (find(cameras.begin(), cameras.end(), camera) == cameras.end())
+          cameras.push_back(move(camera));
       }
-      catch (...)
+      if (cameras.empty())
+        return false;
+      thread(handleMuxClient, move(socket), move(cameras), ref(service.getEncoder()), ref(service.getFanout()),
+             fps ? clamp(stoi(fps), 1, 60) : 0)
+          .detach();
+      return true;
+    }
+
+    // /debug/trace?ms=2000
+    if (path == "/debug/trace")
+    {
+      if (traceCaptureRunning.exchange(true))
       {
-        cerr << "Invalid camera ID in request" << endl;
+        string response = "HTTP/1.1 409 Conflict\r\nContent-Length: 0\r\n\r\n";
+        boost::system::error_code error;
+        write(socket, buffer(response), error);
+        return true;
       }
+      const char *ms = request.url_params.get("ms");
+      thread(handleTrace, move(socket), milliseconds(ms ? atoi(ms) : 2000)).detach();
+      return true;
+    }
+
+    // /cameras/<id>/playback?from=<unix seconds>&speed=<factor>
+    const string playback = "/playback";
+    if (path.rfind("/cameras/", 0) == 0 && path.size() > playback.size() &&
+        path.compare(path.size() - playback.size(), playback.size(), playback) == 0)
+    {
+      int cameraId = stoi(path.substr(9));
+      const char *from = request.url_params.get("from");
+      const char *speedParam = request.url_params.get("speed");
+      int64_t fromUs = from ? (int64_t)(stod(from) * 1e6) : 0;
+      double speed = speedParam ? clamp(stod(speedParam), 0.1, 64.0) : 1.0;
+      thread(handlePlayback, move(socket), ref(service.getRecorder()), cameraId, fromUs, speed).detach();
+      return true;
+    }
+
+    // /cameras/<id>/thumbnails?from=<unix seconds>&to=<unix seconds>&limit=500
+    // (default: the last hour, thinned to 500)
+    const string thumbnailsPath = "/thumbnails";
+    if (path.rfind("/cameras/", 0) == 0 && path.size() > thumbnailsPath.size() &&
+        path.compare(path.size() - thumbnailsPath.size(), thumbnailsPath.size(), thumbnailsPath) == 0)
+    {
+      int cameraId = stoi(path.substr(9));
+      const char *from = request.url_params.get("from");
+      const char *to = request.url_params.get("to");
+      const char *limit = request.url_params.get("limit");
+      int64_t toUs = to ? (int64_t)(atof(to) * 1e6)
+                        : duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+      int64_t fromUs = from ? (int64_t)(atof(from) * 1e6) : toUs - 3600LL * 1000000;
+      size_t count = clamp(limit ? atoi(limit) : 500, 1, 5000);
+      thread(handleThumbnails, move(socket), ref(service.getThumbnails()), cameraId, fromUs, toUs, count).detach();
+      return true;
+    }
+
+    // /<id>?fps=5&w=640&h=360&quality=60&format=mjpeg|jpeg
+    if (path.size() > 1 && all_of(path.begin() + 1, path.end(), [](unsigned char c)
+                                  { return isdigit(c); }))
+    {
+      int cameraId = stoi(path.substr(1));
+      auto camera = service.getCamera(cameraId);
+      if (!camera)
+      {
+        LOG_WARNING("Camera %d not found", cameraId);
+        return false;
+      }
+
+      auto param = [&](const char *name, int low, int high)
+      {
+        const char *value = request.url_params.get(name);
+        return value ? clamp(stoi(value), low, high) : 0;
+      };
+      RenditionKey key;
+      key.width = param("w", 16, 7680);
+      key.height = param("h", 16, 4320);
+      key.quality = param("quality", 10, 100);
+      int fps = param("fps", 1, 60);
+      if (fps >= camera->frameRate)
+        fps = 0;
+      const char *format = request.url_params.get("format");
+      string formatName = format ? format : "mjpeg";
+      if (formatName != "mjpeg" && formatName != "jpeg")
+      {
+        string response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        boost::system::error_code error;
+        write(socket, buffer(response), error);
+        return true;
+      }
+      thread(handleClient, move(socket), camera, cameraId, ref(service.getEncoder()), key, fps, formatName == "jpeg")
+          .detach();
+      return true;
     }
   }
-  catch (exception &e)
+  catch (exception &)
+  {
+    LOG_WARNING("Invalid stream request for %s", request.raw_url.c_str());
+  }
+  return false;
+}
+
+int envInt(const char *name, int fallback)
+{
+  const char *value = getenv(name);
+  return value ? atoi(value) : fallback;
+}
+
+// A count such as a thread pool size; negative values are rejected rather
+// than wrapped around to a huge size_t.
+size_t envCount(const char *name, size_t fallback)
+{
+  int value = envInt(name, (int)fallback);
+  if (value < 0)
   {
-    cerr << "Server error: " << e.what() << endl;
+    LOG_ERROR("Ignoring %s=%d: must not be negative", name, value);
+    return fallback;
   }
+  return value;
 }
 
 int main()
 {
+  initLogging();
+  loadThreadTuning();
   crow::SimpleApp app;
-  CameraService cameraService;
+
+  const char *storePath = getenv("CAMERA_STORE_PATH");
+  CameraStore cameraStore(storePath ? storePath : "cameras.json");
+  const char *recordingsDir = getenv("RECORDINGS_DIR");
+  RetentionLimits retentionLimits;
+  retentionLimits.maxTotalBytes = (uint64_t)envInt("RETENTION_MAX_GB", 0) << 30;
+  retentionLimits.maxCameraBytes = (uint64_t)envInt("RETENTION_CAMERA_MAX_GB", 0) << 30;
+  retentionLimits.minFreePercent = envInt("RETENTION_MIN_FREE_PERCENT", 10);
+  CameraService cameraService(cameraStore, envCount("CAPTURE_WORKERS", 0),
+                              envCount("ENCODER_THREADS", max(1u, thread::hardware_concurrency() / 2)),
+                              envInt("JPEG_QUALITY", 90), recordingsDir ? recordingsDir : "recordings",
+                              seconds(max(1, envInt("RECORDING_SEGMENT_SECONDS", 60))),
+                              envCount("PRE_EVENT_MAX_MB", 8) << 20,
+                              envCount("PRE_EVENT_TOTAL_MAX_MB", 512) << 20, retentionLimits,
+                              seconds(envInt("THUMBNAIL_INTERVAL_SECONDS", 10)),
+                              clamp(envInt("THUMBNAIL_WIDTH", 160), 16, 1920), envCount("MOTION_THREADS", 1),
+                              milliseconds(clamp(envInt("EVENTS_BATCH_MS", 250), 10, 10000)));
+  cameraService.restoreCameras(milliseconds(envInt("CAMERA_RESTORE_STAGGER_MS", 20)));
+
+  // Streams and the REST API share one engine; both ports serve every route.
+  HttpServer server(
+      app, [&](ip::tcp::socket &socket, const crow::request &request)
+      { return serveStream(cameraService, socket, request); },
+      max(1, envInt("NETWORK_THREADS", 2)), seconds(max(1, envInt("HTTP_IDLE_TIMEOUT_SECONDS", 5))),
+      seconds(max(1, envInt("HTTP_HEADER_TIMEOUT_SECONDS", 10))),
+      seconds(max(1, envInt("HTTP_REQUEST_TIMEOUT_SECONDS", 30))));
 
   CROW_ROUTE(app, "/cameras")
       .methods("POST"_method)([&](const crow::request &req)
@@ -212,8 +842,12 @@ int main()
         try {
             string url = json["url"].s();
             int frameRate = json["frameRate"].i();
-            std::cout << "URL: " << url << " Frame Rate: " << frameRate << std::endl;
-            int id = cameraService.addCamera(url, frameRate);
+            StoredCamera settings{0, url, frameRate};
+            settings.record = json.has("record") && json["record"].b();
+            settings.preEventSeconds = json.has("preEventSeconds") ? (int)json["preEventSeconds"].i() : 0;
+            settings.motionFps = json.has("motionFps") ? clamp((int)json["motionFps"].i(), 0, 30) : 0;
+            LOG_INFO("Adding camera %s at %d fps%s", url.c_str(), frameRate, settings.record ? ", recording" : "");
+            int id = cameraService.addCamera(settings);
             return crow::response(200, "Camera added with ID: " + to_string(id));
         } catch (exception& e) {
             return crow::response(500, e.what());
@@ -225,7 +859,157 @@ int main()
         cameraService.removeCamera(id);
         return crow::response(200, "Camera removed"); });
 
-  thread(streamServer, ref(cameraService)).detach();
-  app.port(3001).run();
+  CROW_ROUTE(app, "/cameras/<int>/latency")
+  ([&](int id)
+   {
+        auto camera = cameraService.getCamera(id);
+        if (!camera) return crow::response(404, "Camera not found");
+
+        auto stage = [](const LatencyHistogram &histogram)
+        {
+          crow::json::wvalue json;
+          json["count"] = histogram.getCount();
+          json["meanUs"] = histogram.getCount() ? histogram.getSumUs() / histogram.getCount() : 0;
+          json["p50Us"] = histogram.percentileUs(50);
+          json["p90Us"] = histogram.percentileUs(90);
+          json["p99Us"] = histogram.percentileUs(99);
+          return json;
+        };
+
+        crow::json::wvalue json;
+        json["decode"] = stage(camera->latency.decode);
+        json["captureToEncode"] = stage(camera->latency.captureToEncode);
+        json["encode"] = stage(camera->latency.encode);
+        json["captureToSend"] = stage(camera->latency.captureToSend);
+        return crow::response(json); });
+
+  // GET: latest motion score, boxes and event state, plus analysis cost.
+  // PUT {"fps": n}: analyse n frames per second (0-30, 0 turns it off).
+  CROW_ROUTE(app, "/cameras/<int>/motion")
+      .methods("GET"_method, "PUT"_method)([&](const crow::request &req, int id)
+                                           {
+        auto camera = cameraService.getCamera(id);
+        if (!camera) return crow::response(404, "Camera not found");
+
+        if (req.method == "PUT"_method)
+        {
+          auto json = crow::json::load(req.body);
+          if (!json || !json.has("fps")) return crow::response(400, "Expected {\"fps\": n}");
+          int fps = json["fps"].i();
+          if (fps < 0 || fps > 30) return crow::response(400, "fps must be 0-30");
+          cameraService.setMotionFps(id, fps);
+        }
+
+        MotionState state;
+        cameraService.getMotion().getState(id, state);
+        uint64_t analysed = camera->metrics.motionAnalysed.value();
+        uint64_t cpuUs = camera->metrics.motionCpuUs.value();
+
+        vector<crow::json::wvalue> boxes;
+        for (auto &box : state.boxes)
+        {
+          crow::json::wvalue json;
+          json["x"] = box.x;
+          json["y"] = box.y;
+          json["width"] = box.width;
+          json["height"] = box.height;
+          boxes.push_back(move(json));
+        }
+        crow::json::wvalue json;
+        json["fps"] = camera->motionFps.load();
+        json["score"] = state.score;
+        json["active"] = state.active;
+        json["boxes"] = move(boxes);
+        json["timeUs"] = state.timeUs;
+        json["eventStartUs"] = state.eventStartUs;
+        json["events"] = state.events;
+        json["framesAnalysed"] = analysed;
+        json["cpuUsPerFrame"] = analysed ? cpuUs / analysed : 0;
+        // Share of one core the analysis takes at the configured rate.
+        json["cpuLoad"] = analysed ? (double)cpuUs / analysed * camera->motionFps / 1e6 : 0.0;
+        return crow::response(json); });
+
+  CROW_ROUTE(app, "/cameras/<int>/recordings")
+  ([&](int id)
+   {
+        vector<crow::json::wvalue> segments;
+        for (auto &segment : cameraService.getRecorder().listSegments(id))
+        {
+          crow::json::wvalue json;
+          json["startUs"] = segment.startUs;
+          json["endUs"] = segment.endUs;
+          json["frames"] = segment.frames;
+          json["bytes"] = segment.bytes;
+          json["open"] = segment.open;
+          segments.push_back(move(json));
+        }
+        crow::json::wvalue json;
+        json["segments"] = move(segments);
+        return crow::response(json); });
+
+  CROW_ROUTE(app, "/cameras/<int>/clips")
+      .methods("POST"_method)([&](const crow::request &req, int id)
+                              {
+        int postSeconds = 10;
+        if (!req.body.empty())
+        {
+          auto json = crow::json::load(req.body);
+          if (!json) return crow::response(400, "Invalid JSON");
+          if (json.has("postSeconds")) postSeconds = json["postSeconds"].i();
+        }
+        if (postSeconds < 0 || postSeconds > 300) return crow::response(400, "postSeconds must be 0-300");
+
+        auto [path, preEventFrames] = cameraService.createClip(id, seconds(postSeconds));
+        if (path.empty()) return crow::response(404, "Camera not found");
+
+        crow::json::wvalue json;
+        json["clip"] = path + ".mjpeg";
+        json["preEventFrames"] = preEventFrames;
+        json["postSeconds"] = postSeconds;
+        return crow::response(201, json); });
+
+  // Pushes health, motion and stats events; see EventHub for the protocol.
+  CROW_WEBSOCKET_ROUTE(app, "/events")
+      .onaccept([](const crow::request &, void **userdata)
+                {
+        *userdata = reinterpret_cast<void *>((intptr_t)HttpServer::upgradingSocket());
+        return true; })
+      .onopen([&](crow::websocket::connection &conn)
+              { cameraService.getEvents().addClient(&conn, (int)(intptr_t)conn.userdata()); })
+      .onclose([&](crow::websocket::connection &conn, const string &)
+               { cameraService.getEvents().removeClient(&conn); })
+      .onmessage([&](crow::websocket::connection &conn, const string &data, bool isBinary)
+                 {
+        if (isBinary || !cameraService.getEvents().handleMessage(&conn, data))
+          conn.send_text(R"({"error":"expected {\"subscribe\": [ids]} or {\"subscribe\": \"all\"}"})"); });
+
+  // Binary video frames of any number of cameras; see WebSocketStreamHub.
+  CROW_WEBSOCKET_ROUTE(app, "/stream")
+      .onopen([&](crow::websocket::connection &conn)
+              { cameraService.getWebStreams().addClient(&conn); })
+      .onclose([&](crow::websocket::connection &conn, const string &)
+               { cameraService.getWebStreams().removeClient(&conn); })
+      .onmessage([&](crow::websocket::connection &conn, const string &data, bool isBinary)
+                 {
+        string error = "expected a text message";
+        if (isBinary || !cameraService.getWebStreams().handleMessage(&conn, data, error))
+        {
+          crow::json::wvalue json;
+          json["error"] = error;
+          conn.send_text(json.dump());
+        } });
+
+  CROW_ROUTE(app, "/metrics")
+  ([&]
+   {
+        crow::response response(renderPrometheusMetrics(cameraService.listCameras(), cameraService.getEncoder(),
+                                                         cameraService.getRecorder(), cameraService.getRetention(),
+                                                         server));
+        response.set_header("Content-Type", "text/plain; version=0.0.4");
+        return response; });
+
+  server.listen(3000);
+  server.listen(3001);
+  server.run();
   return 0;
 }
\ No newline at end of file
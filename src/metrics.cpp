@@ -0,0 +1,192 @@
+#include "metrics.h"
+
+#include <functional>
+#include <sstream>
+#include "http_server.h"
+
+using namespace std;
+
+namespace
+{
+  using CameraList = vector<pair<int, shared_ptr<CameraConfig>>>;
+
+  void family(ostringstream &out, const char *name, const char *type, const char *help)
+  {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+  }
+
+  void perCamera(ostringstream &out, const CameraList &cameras, const char *name, const char *type, const char *help,
+                 const function<double(CameraConfig &)> &value)
+  {
+    family(out, name, type, help);
+    for (auto &[id, camera] : cameras)
+    {
+      out << name << "{camera=\"" << id << "\"} " << value(*camera) << "\n";
+    }
+  }
+
+  // Buckets at every second power of two from 16us to ~67s; finer buckets
+  // would multiply the series count per camera for little benefit.
+  void perCameraHistogram(ostringstream &out, const CameraList &cameras, const char *name, const char *help,
+                          const function<const LatencyHistogram &(CameraConfig &)> &histogramOf)
+  {
+    family(out, name, "histogram", help);
+    for (auto &[id, camera] : cameras)
+    {
+      const LatencyHistogram &histogram = histogramOf(*camera);
+      uint64_t cumulative = 0;
+      int bucket = 0;
+      for (uint64_t boundUs = 16; boundUs <= (1ull << 26); boundUs <<= 2)
+      {
+        while (bucket < LatencyHistogram::bucketCount && LatencyHistogram::bucketUpperBoundUs(bucket) <= boundUs)
+        {
+          cumulative += histogram.getBucket(bucket++);
+        }
+        out << name << "_bucket{camera=\"" << id << "\",le=\"" << boundUs / 1e6 << "\"} " << cumulative << "\n";
+      }
+      out << name << "_bucket{camera=\"" << id << "\",le=\"+Inf\"} " << histogram.getCount() << "\n"
+          << name << "_sum{camera=\"" << id << "\"} " << histogram.getSumUs() / 1e6 << "\n"
+          << name << "_count{camera=\"" << id << "\"} " << histogram.getCount() << "\n";
+    }
+  }
+}
+
+string renderPrometheusMetrics(const CameraList &cameras, JpegEncoderPool &encoder, RecordingEngine &recorder,
+                               const RetentionManager &retention, const HttpServer &http)
+{
+  ostringstream out;
+
+  family(out, "rtsp_cameras", "gauge", "Registered cameras.");
+  out << "rtsp_cameras " << cameras.size() << "\n";
+
+  family(out, "rtsp_camera_health", "gauge", "1 for the camera's current health state.");
+  for (auto &[id, camera] : cameras)
+  {
+    out << "rtsp_camera_health{camera=\"" << id << "\",state=\"" << healthName(camera->health) << "\"} 1\n";
+  }
+
+  perCamera(out, cameras, "rtsp_camera_configured_fps", "gauge", "Configured capture frame rate.",
+            [](CameraConfig &c)
+            { return c.frameRate; });
+  perCamera(out, cameras, "rtsp_camera_capture_fps", "gauge", "Smoothed rate of captured frames.",
+            [](CameraConfig &c)
+            { return c.metrics.captureFps.load(); });
+  perCamera(out, cameras, "rtsp_camera_viewers", "gauge", "Connected MJPEG viewers.",
+            [](CameraConfig &c)
+            { return c.metrics.viewers.load(); });
+  perCamera(out, cameras, "rtsp_camera_pre_event_bytes", "gauge", "Memory held by the pre-event buffer.",
+            [](CameraConfig &c)
+            { return c.metrics.preEventBytes.load(); });
+  perCamera(out, cameras, "rtsp_camera_pre_event_frames", "gauge", "Frames held by the pre-event buffer.",
+            [](CameraConfig &c)
+            { return c.metrics.preEventFrames.load(); });
+  perCamera(out, cameras, "rtsp_camera_frames_captured_total", "counter", "Frames read from the source.",
+            [](CameraConfig &c)
+            { return c.metrics.framesCaptured.value(); });
+  perCamera(out, cameras, "rtsp_camera_empty_reads_total", "counter", "Reads that returned no frame.",
+            [](CameraConfig &c)
+            { return c.metrics.emptyReads.value(); });
+  perCamera(out, cameras, "rtsp_camera_reconnects_total", "counter", "Times the stream was lost and reopened.",
+            [](CameraConfig &c)
+            { return c.metrics.reconnects.value(); });
+  perCamera(out, cameras, "rtsp_camera_frames_encoded_total", "counter", "Frames encoded to JPEG.",
+            [](CameraConfig &c)
+            { return c.metrics.framesEncoded.value(); });
+  perCamera(out, cameras, "rtsp_camera_rendition_frames_encoded_total", "counter",
+            "Frames encoded for scaled or re-compressed renditions.", [](CameraConfig &c)
+            { return c.metrics.renditionFramesEncoded.value(); });
+  perCamera(out, cameras, "rtsp_camera_frames_sent_total", "counter", "Frame parts sent to viewers.",
+            [](CameraConfig &c)
+            { return c.metrics.framesSent.value(); });
+  perCamera(out, cameras, "rtsp_camera_bytes_sent_total", "counter", "Bytes of frame parts sent to viewers.",
+            [](CameraConfig &c)
+            { return c.metrics.bytesSent.value(); });
+
+  perCamera(out, cameras, "rtsp_camera_frames_recorded_total", "counter", "Frames written to recordings.",
+            [](CameraConfig &c)
+            { return c.metrics.framesRecorded.value(); });
+  perCamera(out, cameras, "rtsp_camera_bytes_recorded_total", "counter", "Bytes written to recordings.",
+            [](CameraConfig &c)
+            { return c.metrics.bytesRecorded.value(); });
+  perCamera(out, cameras, "rtsp_camera_thumbnails_written_total", "counter", "Timeline thumbnails written.",
+            [](CameraConfig &c)
+            { return c.metrics.thumbnailsWritten.value(); });
+
+  perCamera(out, cameras, "rtsp_camera_motion_score", "gauge", "Share of the picture that changed in the last analysis.",
+            [](CameraConfig &c)
+            { return c.metrics.motionScore.load(); });
+  perCamera(out, cameras, "rtsp_camera_motion_events_total", "counter", "Motion events detected.",
+            [](CameraConfig &c)
+            { return c.metrics.motionEvents.value(); });
+  perCamera(out, cameras, "rtsp_camera_motion_frames_analysed_total", "counter", "Frames analysed for motion.",
+            [](CameraConfig &c)
+            { return c.metrics.motionAnalysed.value(); });
+  perCamera(out, cameras, "rtsp_camera_motion_cpu_seconds_total", "counter", "CPU time spent on motion analysis.",
+            [](CameraConfig &c)
+            { return c.metrics.motionCpuUs.value() / 1e6; });
+
+  family(out, "rtsp_camera_dropped_frames_total", "counter", "Frames skipped because a stage fell behind.");
+  for (auto &[id, camera] : cameras)
+  {
+    out << "rtsp_camera_dropped_frames_total{camera=\"" << id << "\",stage=\"encode\"} "
+        << camera->metrics.encodeDropped.value() << "\n"
+        << "rtsp_camera_dropped_frames_total{camera=\"" << id << "\",stage=\"send\"} "
+        << camera->metrics.sendDropped.value() << "\n"
+        << "rtsp_camera_dropped_frames_total{camera=\"" << id << "\",stage=\"record\"} "
+        << camera->metrics.recordDropped.value() << "\n"
+        << "rtsp_camera_dropped_frames_total{camera=\"" << id << "\",stage=\"thumbnail\"} "
+        << camera->metrics.thumbnailDropped.value() << "\n"
+        << "rtsp_camera_dropped_frames_total{camera=\"" << id << "\",stage=\"motion\"} "
+        << camera->metrics.motionDropped.value() << "\n";
+  }
+
+  perCameraHistogram(out, cameras, "rtsp_camera_decode_seconds", "Time spent reading and decoding a frame.",
+                     [](CameraConfig &c) -> const LatencyHistogram &
+                     { return c.latency.decode; });
+  perCameraHistogram(out, cameras, "rtsp_camera_encode_seconds", "Time spent encoding a frame to JPEG.",
+                     [](CameraConfig &c) -> const LatencyHistogram &
+                     { return c.latency.encode; });
+  perCameraHistogram(out, cameras, "rtsp_camera_capture_to_encode_seconds", "Capture to encoded frame latency.",
+                     [](CameraConfig &c) -> const LatencyHistogram &
+                     { return c.latency.captureToEncode; });
+  perCameraHistogram(out, cameras, "rtsp_camera_capture_to_send_seconds", "Capture to frame sent latency.",
+                     [](CameraConfig &c) -> const LatencyHistogram &
+                     { return c.latency.captureToSend; });
+
+  EncodedFramePool &pool = encoder.getFramePool();
+  family(out, "rtsp_encoder_threads", "gauge", "JPEG encoder threads.");
+  out << "rtsp_encoder_threads " << encoder.getThreadCount() << "\n";
+  family(out, "rtsp_encoder_queue_depth", "gauge", "Cameras waiting for an encoder thread.");
+  out << "rtsp_encoder_queue_depth " << encoder.getQueueDepth() << "\n";
+  family(out, "rtsp_buffer_pool_hits_total", "counter", "Encoded frame buffers reused from the pool.");
+  out << "rtsp_buffer_pool_hits_total " << pool.getHits() << "\n";
+  family(out, "rtsp_buffer_pool_misses_total", "counter", "Encoded frame buffers newly allocated.");
+  out << "rtsp_buffer_pool_misses_total " << pool.getMisses() << "\n";
+  family(out, "rtsp_buffer_pool_available", "gauge", "Buffers waiting in the pool.");
+  out << "rtsp_buffer_pool_available " << pool.getAvailable() << "\n";
+  family(out, "rtsp_buffer_pool_bytes", "gauge", "Capacity held by pooled buffers.");
+  out << "rtsp_buffer_pool_bytes " << pool.getPooledBytes() << "\n";
+
+  family(out, "rtsp_storage_used_bytes", "gauge", "Bytes of recorded segments on disk.");
+  out << "rtsp_storage_used_bytes " << recorder.getUsedBytes() << "\n";
+  // By camera id on disk, so cameras removed since still show up.
+  family(out, "rtsp_storage_camera_used_bytes", "gauge", "Bytes of recorded segments on disk per camera.");
+  for (auto &[id, bytes] : recorder.getCameraUsage())
+  {
+    out << "rtsp_storage_camera_used_bytes{camera=\"" << id << "\"} " << bytes << "\n";
+  }
+  family(out, "rtsp_storage_evicted_segments_total", "counter", "Segments deleted by retention.");
+  out << "rtsp_storage_evicted_segments_total " << retention.getEvictedSegments() << "\n";
+  family(out, "rtsp_storage_evicted_bytes_total", "counter", "Bytes deleted by retention.");
+  out << "rtsp_storage_evicted_bytes_total " << retention.getEvictedBytes() << "\n";
+
+  family(out, "rtsp_http_open_connections", "gauge", "HTTP connections reading or answering requests.");
+  out << "rtsp_http_open_connections " << http.getOpenConnections() << "\n";
+  family(out, "rtsp_http_request_timeouts_total", "counter", "Connections closed for sending a request too slowly.");
+  out << "rtsp_http_request_timeouts_total " << http.getRequestTimeouts() << "\n";
+  family(out, "rtsp_http_rejected_requests_total", "counter", "Malformed or oversized HTTP requests.");
+  out << "rtsp_http_rejected_requests_total " << http.getRejectedRequests() << "\n";
+
+  return out.str();
+}
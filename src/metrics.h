@@ -0,0 +1,18 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "camera.h"
+#include "encoder.h"
+#include "retention.h"
+
+class HttpServer;
+
+// Renders the pipeline's counters, gauges and latency histograms in the
+// Prometheus text exposition format. Only reads the lock-free counters the
+// pipeline updates as it runs, so scraping never blocks capture or viewers.
+std::string renderPrometheusMetrics(const std::vector<std::pair<int, std::shared_ptr<CameraConfig>>> &cameras,
+                                    JpegEncoderPool &encoder, RecordingEngine &recorder,
+                                    const RetentionManager &retention, const HttpServer &http);
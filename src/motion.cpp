@@ -0,0 +1,288 @@
+#include "motion.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include "thread_tuning.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  // Width of the analysed picture; the height follows the aspect ratio.
+  constexpr int analysisWidth = 160;
+  // Grey levels a pixel must differ from the background to count as changed.
+  constexpr int pixelThreshold = 24;
+  // Share of changed pixels that starts a motion event.
+  constexpr float scoreThreshold = 0.004f;
+  // Changed regions smaller than this many analysed pixels are noise.
+  constexpr int minBoxPixels = 12;
+  constexpr size_t maxBoxes = 16;
+  // An event ends after this long without motion.
+  constexpr int64_t eventHoldUs = 2000000;
+  // A background older than this (analysis paused or the clock stepped) is
+  // rebuilt from the next frame instead of reporting everything as motion.
+  constexpr int64_t backgroundStaleUs = 5000000;
+
+  int64_t threadCpuUs()
+  {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  }
+
+  // Marks pixels further than `threshold` from the background and moves the
+  // background 1/16 of the way towards the frame. The background keeps four
+  // fractional bits so it converges fully. Branch-free integer arithmetic
+  // over non-aliasing arrays, so the compiler turns it into SIMD code.
+  void subtractBackground(const uint8_t *__restrict frame, int16_t *__restrict background, uint8_t *__restrict mask,
+                          size_t pixels, int threshold)
+  {
+    const int scaledThreshold = threshold << 4;
+    for (size_t i = 0; i < pixels; i++)
+    {
+      int diff = (frame[i] << 4) - background[i];
+      mask[i] = abs(diff) > scaledThreshold ? 255 : 0;
+      background[i] = (int16_t)(background[i] + (diff >> 4));
+    }
+  }
+
+  void resetBackground(const uint8_t *__restrict frame, int16_t *__restrict background, size_t pixels)
+  {
+    for (size_t i = 0; i < pixels; i++)
+    {
+      background[i] = (int16_t)(frame[i] << 4);
+    }
+  }
+}
+
+struct MotionDetector::CameraMotion
+{
+  shared_ptr<CameraConfig> camera;
+  // Guarded by motionMutex.
+  Mat pending;
+  int64_t pendingTimeUs = 0;
+  bool queued = false;
+  bool busy = false;
+  int64_t nextDueUs = 0;
+  MotionState state;
+  int64_t lastMotionUs = 0;
+
+  // Only touched by the worker analysing the camera.
+  vector<int16_t> background;
+  Mat mask;
+  int64_t lastAnalysedUs = 0;
+};
+
+MotionDetector::MotionDetector(size_t threadCount)
+{
+  for (size_t i = 0; i < max<size_t>(threadCount, 1); i++)
+  {
+    workers.emplace_back(&MotionDetector::workerLoop, this);
+  }
+}
+
+MotionDetector::~MotionDetector()
+{
+  {
+    lock_guard<mutex> lock(motionMutex);
+    stopping = true;
+  }
+  queueChanged.notify_all();
+  for (auto &worker : workers)
+  {
+    worker.join();
+  }
+}
+
+void MotionDetector::startCamera(shared_ptr<CameraConfig> camera)
+{
+  auto motion = make_shared<CameraMotion>();
+  motion->camera = camera;
+
+  lock_guard<mutex> lock(motionMutex);
+  cameras[camera->id] = move(motion);
+}
+
+void MotionDetector::stopCamera(int cameraId)
+{
+  lock_guard<mutex> lock(motionMutex);
+  cameras.erase(cameraId);
+}
+
+void MotionDetector::frameCaptured(CameraConfig &camera, const Mat &frame, const FrameInfo &info)
+{
+  int fps = camera.motionFps;
+  if (fps <= 0)
+    return;
+
+  {
+    lock_guard<mutex> lock(motionMutex);
+    auto it = cameras.find(camera.id);
+    if (it == cameras.end())
+      return;
+    CameraMotion &motion = *it->second;
+
+    int64_t timeUs = info.captureTimeUs;
+    if (timeUs < motion.nextDueUs && motion.nextDueUs - timeUs <= 1000000)
+      return;
+    motion.nextDueUs = timeUs + 1000000 / fps;
+
+    if (!motion.pending.empty())
+    {
+      // The frame still waiting for a worker is superseded by this one.
+      camera.metrics.motionDropped.add();
+    }
+    motion.pending = frame;
+    motion.pendingTimeUs = timeUs;
+    if (motion.queued || motion.busy)
+      return;
+    motion.queued = true;
+    ready.push_back(it->second);
+  }
+  queueChanged.notify_one();
+}
+
+bool MotionDetector::getState(int cameraId, MotionState &state)
+{
+  lock_guard<mutex> lock(motionMutex);
+  auto it = cameras.find(cameraId);
+  if (it == cameras.end())
+    return false;
+  state = it->second->state;
+  return true;
+}
+
+void MotionDetector::workerLoop()
+{
+  applyThreadTuning(ThreadRole::Encode);
+  setTraceThreadName("motion");
+
+  unique_lock<mutex> lock(motionMutex);
+  while (!stopping)
+  {
+    if (ready.empty())
+    {
+      queueChanged.wait(lock);
+      continue;
+    }
+
+    auto motion = move(ready.front());
+    ready.pop_front();
+    motion->queued = false;
+    motion->busy = true;
+    Mat frame = move(motion->pending);
+    motion->pending = Mat();
+    int64_t timeUs = motion->pendingTimeUs;
+    lock.unlock();
+
+    analyse(*motion, frame, timeUs);
+    frame = Mat();
+
+    lock.lock();
+    motion->busy = false;
+    // A frame that arrived during the analysis waited for this one to finish.
+    if (!motion->pending.empty())
+    {
+      motion->queued = true;
+      ready.push_back(move(motion));
+    }
+  }
+}
+
+void MotionDetector::analyse(CameraMotion &motion, const Mat &frame, int64_t timeUs)
+{
+  CameraConfig &camera = *motion.camera;
+  TraceSpan span("motion", camera.id);
+  int64_t cpuStartUs = threadCpuUs();
+
+  // Nearest-neighbour decimation only reads the pixels it keeps; the 2:1
+  // area step after it takes out most of the aliasing.
+  int height = max(1, analysisWidth * frame.rows / max(1, frame.cols));
+  Mat coarse, small, gray;
+  resize(frame, coarse, Size(analysisWidth * 2, height * 2), 0, 0, INTER_NEAREST);
+  resize(coarse, small, Size(analysisWidth, height), 0, 0, INTER_AREA);
+  cvtColor(small, gray, COLOR_BGR2GRAY);
+
+  size_t pixels = (size_t)analysisWidth * height;
+  bool stale = motion.background.size() != pixels || timeUs - motion.lastAnalysedUs > backgroundStaleUs ||
+               timeUs < motion.lastAnalysedUs;
+  motion.lastAnalysedUs = timeUs;
+
+  float score = 0;
+  vector<MotionBox> boxes;
+  if (stale)
+  {
+    motion.background.resize(pixels);
+    motion.mask.create(height, analysisWidth, CV_8UC1);
+    resetBackground(gray.ptr<uint8_t>(), motion.background.data(), pixels);
+  }
+  else
+  {
+    subtractBackground(gray.ptr<uint8_t>(), motion.background.data(), motion.mask.ptr<uint8_t>(), pixels,
+                       pixelThreshold);
+    // Drops isolated pixels (sensor noise, compression artefacts).
+    static const Mat kernel = getStructuringElement(MORPH_RECT, Size(3, 3));
+    morphologyEx(motion.mask, motion.mask, MORPH_OPEN, kernel);
+
+    int changed = countNonZero(motion.mask);
+    score = (float)changed / pixels;
+    if (changed >= minBoxPixels)
+    {
+      Mat labels, stats, centroids;
+      int regions = connectedComponentsWithStats(motion.mask, labels, stats, centroids, 8, CV_32S);
+      for (int i = 1; i < regions; i++)
+      {
+        if (stats.at<int>(i, CC_STAT_AREA) < minBoxPixels)
+          continue;
+        boxes.push_back({(float)stats.at<int>(i, CC_STAT_LEFT) / analysisWidth,
+                         (float)stats.at<int>(i, CC_STAT_TOP) / height,
+                         (float)stats.at<int>(i, CC_STAT_WIDTH) / analysisWidth,
+                         (float)stats.at<int>(i, CC_STAT_HEIGHT) / height});
+      }
+      // Largest first, so a capped list keeps what matters.
+      sort(boxes.begin(), boxes.end(), [](const MotionBox &a, const MotionBox &b)
+           { return a.width * a.height > b.width * b.height; });
+      if (boxes.size() > maxBoxes)
+        boxes.resize(maxBoxes);
+    }
+  }
+
+  MotionState changed;
+  bool notify = false;
+  {
+    lock_guard<mutex> lock(motionMutex);
+    MotionState &state = motion.state;
+    bool wasActive = state.active;
+    state.score = score;
+    state.boxes = move(boxes);
+    state.timeUs = timeUs;
+    if (score >= scoreThreshold)
+    {
+      motion.lastMotionUs = timeUs;
+      if (!state.active)
+      {
+        state.active = true;
+        state.eventStartUs = timeUs;
+        state.events++;
+        camera.metrics.motionEvents.add();
+      }
+    }
+    else if (state.active && timeUs - motion.lastMotionUs > eventHoldUs)
+    {
+      state.active = false;
+    }
+    notify = onChange && (state.active || wasActive);
+    if (notify)
+      changed = state;
+  }
+
+  camera.metrics.motionScore = score;
+  camera.metrics.motionAnalysed.add();
+  camera.metrics.motionCpuUs.add(threadCpuUs() - cpuStartUs);
+  if (notify)
+    onChange(camera.id, changed);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "capture.h"
+
+// A region that changed, in fractions of the frame's width and height.
+struct MotionBox
+{
+  float x;
+  float y;
+  float width;
+  float height;
+};
+
+struct MotionState
+{
+  // Fraction of the analysed picture that differs from the background.
+  float score = 0;
+  bool active = false;
+  std::vector<MotionBox> boxes;
+  // Capture time of the frame the state was computed from.
+  int64_t timeUs = 0;
+  // Start of the latest motion event, and the number of events so far.
+  int64_t eventStartUs = 0;
+  uint64_t events = 0;
+};
+
+// Optional per-camera motion analysis. At the camera's motionFps a captured
+// frame is shrunk to a small grayscale picture and compared against a
+// running-average background; changed pixels are grouped into boxes. A
+// camera is queued at most once and its newest frame is analysed, so slow
+// analysis skips frames instead of delaying them, and capture never waits.
+// CPU time spent per camera is counted in its metrics.
+class MotionDetector : public CapturedFrameListener
+{
+private:
+  struct CameraMotion;
+
+  std::mutex motionMutex;
+  std::condition_variable queueChanged;
+  std::map<int, std::shared_ptr<CameraMotion>> cameras;
+  std::deque<std::shared_ptr<CameraMotion>> ready;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+  std::function<void(int, const MotionState &)> onChange;
+
+  void workerLoop();
+  void analyse(CameraMotion &motion, const cv::Mat &frame, int64_t timeUs);
+
+public:
+  explicit MotionDetector(size_t threadCount);
+  ~MotionDetector();
+
+  void startCamera(std::shared_ptr<CameraConfig> camera);
+  void stopCamera(int cameraId);
+
+  void frameCaptured(CameraConfig &camera, const cv::Mat &frame, const FrameInfo &info) override;
+
+  // Called on an analysis thread after every analysis during a motion event
+  // and once when it ends. Not synchronized; set before capture starts.
+  void setChangeHandler(std::function<void(int cameraId, const MotionState &state)> handler)
+  {
+    onChange = std::move(handler);
+  }
+
+  // False if the camera isn't analysed.
+  bool getState(int cameraId, MotionState &state);
+};
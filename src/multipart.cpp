@@ -0,0 +1,23 @@
+#include "multipart.h"
+
+#include <cstdio>
+
+using namespace std;
+
+string framePartHeaders(size_t jpegSize, const FrameInfo *info, int cameraId)
+{
+  string headers = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + to_string(jpegSize) + "\r\n";
+  if (cameraId > 0)
+  {
+    headers += "X-Camera-Id: " + to_string(cameraId) + "\r\n";
+  }
+  if (info)
+  {
+    char timestamp[32];
+    snprintf(timestamp, sizeof(timestamp), "%lld.%06lld", (long long)(info->captureTimeUs / 1000000),
+             (long long)(info->captureTimeUs % 1000000));
+    headers += "X-Frame-Seq: " + to_string(info->seq) + "\r\nX-Timestamp: " + timestamp + "\r\n";
+  }
+  headers += "\r\n";
+  return headers;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+#include "camera.h"
+
+// Headers of one multipart/x-mixed-replace part carrying a JPEG, including
+// the boundary line and the blank line that ends them. With `info` the part
+// also carries X-Frame-Seq and X-Timestamp (Unix seconds with microseconds);
+// a positive `cameraId` adds X-Camera-Id for streams that mix cameras.
+std::string framePartHeaders(size_t jpegSize, const FrameInfo *info = nullptr, int cameraId = 0);
@@ -0,0 +1,272 @@
+#include "playback.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "multipart.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  constexpr double maxPlaybackFps = 25;
+  // How often the end of a segment that is still being recorded is re-read.
+  constexpr auto liveEdgePoll = milliseconds(200);
+  // Give up following a recording that stopped growing.
+  constexpr auto idleTimeout = seconds(10);
+  constexpr int64_t idleTimeoutUs = duration_cast<microseconds>(idleTimeout).count();
+  // Recording gaps longer than this are skipped instead of waited out.
+  constexpr int64_t maxGapUs = 2000000;
+
+  int64_t wallClockUs()
+  {
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  }
+
+  bool sendAll(int socketFd, const char *data, size_t size)
+  {
+    while (size > 0)
+    {
+      ssize_t n = ::send(socketFd, data, size, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool sendFileRange(int socketFd, int fileFd, off_t offset, size_t size)
+  {
+    while (size > 0)
+    {
+      ssize_t n = ::sendfile(socketFd, fileFd, &offset, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      size -= n;
+    }
+    return true;
+  }
+
+  // The segment that contains `timeUs`, or the first one after it.
+  size_t findSegment(const vector<RecordedSegment> &segments, int64_t timeUs)
+  {
+    auto it = upper_bound(segments.begin(), segments.end(), timeUs, [](int64_t time, const RecordedSegment &segment)
+                          { return time < segment.startUs; });
+    if (it == segments.begin())
+      return 0;
+    size_t index = it - segments.begin() - 1;
+    if (timeUs > segments[index].endUs && !segments[index].open && index + 1 < segments.size())
+      index++;
+    return index;
+  }
+
+  // A playback cursor over one segment's data and mapped index.
+  struct OpenSegment
+  {
+    RecordedSegment segment;
+    SegmentIndexMap index;
+    int dataFd = -1;
+
+    ~OpenSegment()
+    {
+      if (dataFd >= 0)
+        ::close(dataFd);
+    }
+
+    bool open(const RecordedSegment &next)
+    {
+      if (dataFd >= 0)
+        ::close(dataFd);
+      segment = next;
+      dataFd = ::open(segment.dataPath.c_str(), O_RDONLY | O_CLOEXEC);
+      return dataFd >= 0 && index.open(segment.indexPath);
+    }
+  };
+}
+
+SegmentIndexMap::~SegmentIndexMap()
+{
+  unmap();
+  if (fd >= 0)
+    ::close(fd);
+}
+
+void SegmentIndexMap::unmap()
+{
+  if (entries)
+    munmap(const_cast<SegmentIndexEntry *>(entries), mappedBytes);
+  entries = nullptr;
+  count = 0;
+  mappedBytes = 0;
+}
+
+bool SegmentIndexMap::open(const string &path)
+{
+  unmap();
+  if (fd >= 0)
+    ::close(fd);
+  fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0)
+    return false;
+  // A partially written trailing entry is left out.
+  size_t entryCount = info.st_size / sizeof(SegmentIndexEntry);
+  if (entryCount == 0)
+    return true;
+
+  mappedBytes = entryCount * sizeof(SegmentIndexEntry);
+  void *mapped = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED)
+  {
+    mappedBytes = 0;
+    return false;
+  }
+  entries = static_cast<const SegmentIndexEntry *>(mapped);
+  count = entryCount;
+  return true;
+}
+
+size_t SegmentIndexMap::lowerBound(int64_t timeUs) const
+{
+  const SegmentIndexEntry *first = lower_bound(entries, entries + count, timeUs, [](const SegmentIndexEntry &entry, int64_t time)
+                                               { return entry.timeUs < time; });
+  return first - entries;
+}
+
+size_t SegmentIndexMap::seek(int64_t timeUs) const
+{
+  // A segment's index stays empty until its first flush.
+  if (count == 0)
+    return count;
+  const SegmentIndexEntry *end = entries + count;
+  const SegmentIndexEntry *after = upper_bound(entries, end, timeUs, [](int64_t time, const SegmentIndexEntry &entry)
+                                               { return time < entry.timeUs; });
+  size_t i = after == entries ? 0 : after - entries - 1;
+  for (size_t back = i + 1; back-- > 0;)
+  {
+    if (entries[back].flags & segmentKeyframe)
+      return back;
+  }
+  for (; i < count; i++)
+  {
+    if (entries[i].flags & segmentKeyframe)
+      return i;
+  }
+  return count;
+}
+
+bool streamPlayback(int socketFd, RecordingEngine &recorder, int cameraId, int64_t fromUs, double speed)
+{
+  auto segments = recorder.listSegments(cameraId);
+  if (segments.empty())
+    return false;
+  size_t segmentIndex = findSegment(segments, fromUs);
+  if (fromUs > segments[segmentIndex].endUs && !segments[segmentIndex].open)
+    return false;
+
+  OpenSegment current;
+  if (!current.open(segments[segmentIndex]))
+    return false;
+  size_t frame = current.index.seek(fromUs);
+  // A segment just started has nothing indexed yet; wait at the live edge
+  // and seek once its first entries are flushed.
+  bool seekPending = current.index.size() == 0;
+
+  string header = "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+  if (!sendAll(socketFd, header.data(), header.size()))
+    return true;
+
+  bool fastForward = speed > 1;
+  int64_t minSpacingUs = fastForward ? (int64_t)(speed * 1e6 / maxPlaybackFps) : 0;
+  int64_t mediaStartUs = 0;
+  int64_t lastSentUs = 0;
+  bool started = false;
+  steady_clock::time_point wallStart;
+  auto lastProgress = steady_clock::now();
+  FrameInfo info;
+
+  while (true)
+  {
+    if (frame >= current.index.size())
+    {
+      // End of what is on disk for this segment: move to the next one, or
+      // wait for the recorder to append more.
+      segments = recorder.listSegments(cameraId);
+      auto self = find_if(segments.begin(), segments.end(), [&](const RecordedSegment &segment)
+                          { return segment.startUs == current.segment.startUs; });
+      if (self != segments.end() && (self->open || self->frames > current.index.size()))
+      {
+        current.index.open(current.segment.indexPath);
+        if (seekPending && current.index.size() > 0)
+        {
+          frame = current.index.seek(fromUs);
+          seekPending = false;
+        }
+      }
+      else if (self != segments.end() && self + 1 != segments.end())
+      {
+        if (!current.open(*(self + 1)))
+          return true;
+        frame = 0;
+        seekPending = false;
+        continue;
+      }
+      else if (self == segments.end() || (!self->open && self->endUs < wallClockUs() - idleTimeoutUs))
+      {
+        // The recording ended a while ago; there is nothing left to follow.
+        return true;
+      }
+
+      if (frame >= current.index.size())
+      {
+        if (steady_clock::now() - lastProgress > idleTimeout)
+          return true;
+        this_thread::sleep_for(liveEdgePoll);
+        continue;
+      }
+    }
+
+    const SegmentIndexEntry entry = current.index[frame++];
+    lastProgress = steady_clock::now();
+    if (fastForward && (!(entry.flags & segmentKeyframe) || (started && entry.timeUs - lastSentUs < minSpacingUs)))
+      continue;
+
+    if (!started || entry.timeUs < lastSentUs || entry.timeUs - lastSentUs > maxGapUs)
+    {
+      mediaStartUs = entry.timeUs;
+      wallStart = steady_clock::now();
+      started = true;
+    }
+    this_thread::sleep_until(wallStart + microseconds((int64_t)((entry.timeUs - mediaStartUs) / speed)));
+
+    info.seq++;
+    info.captureTimeUs = entry.timeUs;
+    string headers = framePartHeaders(entry.size, &info);
+    if (!sendAll(socketFd, headers.data(), headers.size()) ||
+        !sendFileRange(socketFd, current.dataFd, entry.offset, entry.size) || !sendAll(socketFd, "\r\n", 2))
+    {
+      return true;
+    }
+    lastSentUs = entry.timeUs;
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "recorder.h"
+
+// Read-only memory mapping of a segment's .idx file. Entries are sorted by
+// time, so seeking is a binary search over the mapped array without reading
+// the index into memory.
+class SegmentIndexMap
+{
+private:
+  int fd = -1;
+  const SegmentIndexEntry *entries = nullptr;
+  size_t count = 0;
+  size_t mappedBytes = 0;
+
+  void unmap();
+
+public:
+  SegmentIndexMap() = default;
+  ~SegmentIndexMap();
+
+  SegmentIndexMap(const SegmentIndexMap &) = delete;
+  SegmentIndexMap &operator=(const SegmentIndexMap &) = delete;
+
+  // (Re)maps the file; call again to pick up entries appended since.
+  bool open(const std::string &path);
+
+  size_t size() const { return count; }
+  const SegmentIndexEntry &operator[](size_t i) const { return entries[i]; }
+
+  // Index of the first entry at or after `timeUs`, or size().
+  size_t lowerBound(int64_t timeUs) const;
+  // Index of the last keyframe at or before `timeUs` (the first keyframe if
+  // `timeUs` precedes it), or size() if there is none.
+  size_t seek(int64_t timeUs) const;
+};
+
+// Streams a camera's recording from `fromUs` as multipart MJPEG to a
+// connected socket, paced at `speed` times real time, until the client goes
+// away or there is nothing more to play. Frame data goes from the segment
+// file to the socket with sendfile(). Faster than real time only keyframes
+// are sent, thinned to at most 25 frames per wall-clock second.
+// Returns false without writing anything if no recording covers `fromUs`.
+bool streamPlayback(int socketFd, RecordingEngine &recorder, int cameraId, int64_t fromUs, double speed);
@@ -0,0 +1,101 @@
+#include "prebuffer.h"
+
+using namespace std;
+using namespace std::chrono;
+
+PreEventBuffer::PreEventBuffer(size_t maxBytesPerCamera, size_t maxTotalBytes)
+    : maxBytesPerCamera(maxBytesPerCamera), maxTotalBytes(maxTotalBytes), cameraLimit(maxBytesPerCamera)
+{
+}
+
+void PreEventBuffer::updateCameraLimit()
+{
+  cameraLimit = min(maxBytesPerCamera, maxTotalBytes / max<size_t>(buffers.size(), 1));
+}
+
+void PreEventBuffer::startBuffering(shared_ptr<CameraConfig> camera, seconds duration, JpegEncoderPool &encoder)
+{
+  auto buffer = make_shared<CameraBuffer>();
+  buffer->camera = camera;
+  buffer->durationUs = duration_cast<microseconds>(duration).count();
+  buffer->subscription = make_unique<JpegSubscription>(encoder, camera);
+
+  lock_guard<mutex> lock(buffersMutex);
+  buffers[camera->id] = move(buffer);
+  updateCameraLimit();
+}
+
+void PreEventBuffer::stopBuffering(int cameraId)
+{
+  shared_ptr<CameraBuffer> buffer;
+  {
+    lock_guard<mutex> lock(buffersMutex);
+    auto it = buffers.find(cameraId);
+    if (it == buffers.end())
+      return;
+    buffer = move(it->second);
+    buffers.erase(it);
+    updateCameraLimit();
+  }
+  buffer->camera->metrics.preEventBytes = 0;
+  buffer->camera->metrics.preEventFrames = 0;
+}
+
+void PreEventBuffer::frameEncoded(CameraConfig &camera, const shared_ptr<const EncodedFrame> &frame)
+{
+  if (camera.preEventSeconds <= 0)
+    return;
+
+  shared_ptr<CameraBuffer> buffer;
+  size_t maxBytes;
+  {
+    lock_guard<mutex> lock(buffersMutex);
+    auto it = buffers.find(camera.id);
+    if (it == buffers.end())
+      return;
+    buffer = it->second;
+    maxBytes = cameraLimit;
+  }
+
+  // A camera that joined lowers everyone's share; each buffer trims itself
+  // down to it with its next frame.
+  lock_guard<mutex> lock(buffer->framesMutex);
+  auto &frames = buffer->frames;
+  // Counted by capacity: that is what the pooled buffer actually holds on to.
+  frames.push_back(frame);
+  buffer->bytes += frame->jpeg.capacity();
+
+  int64_t newestUs = frame->info.captureTimeUs;
+  auto dropOldest = [&]
+  {
+    buffer->bytes -= frames.front()->jpeg.capacity();
+    frames.pop_front();
+  };
+  while (frames.size() > 1 &&
+         (buffer->bytes > maxBytes || newestUs - frames.front()->info.captureTimeUs > buffer->durationUs))
+  {
+    dropOldest();
+  }
+  // A clip has to start at a frame that decodes on its own.
+  while (frames.size() > 1 && !frames.front()->keyframe)
+  {
+    dropOldest();
+  }
+  camera.metrics.preEventBytes = buffer->bytes;
+  camera.metrics.preEventFrames = frames.size();
+}
+
+vector<shared_ptr<const EncodedFrame>> PreEventBuffer::snapshot(int cameraId)
+{
+  shared_ptr<CameraBuffer> buffer;
+  {
+    lock_guard<mutex> lock(buffersMutex);
+    auto it = buffers.find(cameraId);
+    if (it == buffers.end())
+      return {};
+    buffer = it->second;
+  }
+
+  lock_guard<mutex> lock(buffer->framesMutex);
+  return {buffer->frames.begin(), buffer->frames.end()};
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "camera.h"
+#include "encoder.h"
+
+// Keeps the last few seconds of each enabled camera's encoded frames in
+// memory, so a clip triggered by an event can include what led up to it.
+// Frames are the ones the live stream shares (no copy); a camera's buffer is
+// bounded both by duration and by bytes, and always starts at a keyframe.
+// The byte bound is the per-camera limit or an equal share of the total
+// limit, whichever is smaller, so memory stays bounded however many cameras
+// buffer. A buffered camera is encoded continuously, viewers or not.
+class PreEventBuffer : public EncodedFrameListener
+{
+private:
+  struct CameraBuffer
+  {
+    std::shared_ptr<CameraConfig> camera;
+    std::unique_ptr<JpegSubscription> subscription;
+    int64_t durationUs;
+    std::mutex framesMutex;
+    std::deque<std::shared_ptr<const EncodedFrame>> frames;
+    size_t bytes = 0;
+  };
+
+  size_t maxBytesPerCamera;
+  size_t maxTotalBytes;
+  std::mutex buffersMutex;
+  std::map<int, std::shared_ptr<CameraBuffer>> buffers;
+  // Byte bound of each camera's buffer; guarded by buffersMutex.
+  size_t cameraLimit;
+
+  void updateCameraLimit();
+
+public:
+  PreEventBuffer(size_t maxBytesPerCamera, size_t maxTotalBytes);
+
+  void startBuffering(std::shared_ptr<CameraConfig> camera, std::chrono::seconds duration, JpegEncoderPool &encoder);
+  void stopBuffering(int cameraId);
+
+  void frameEncoded(CameraConfig &camera, const std::shared_ptr<const EncodedFrame> &frame) override;
+
+  // The buffered frames, oldest first; empty if the camera isn't buffered.
+  std::vector<std::shared_ptr<const EncodedFrame>> snapshot(int cameraId);
+};
@@ -0,0 +1,660 @@
+#include "recorder.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "logger.h"
+#include "trace.h"
+
+using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+namespace
+{
+  // Frames are gathered into buffers this large before hitting the disk;
+  // page-aligned so the kernel can copy whole pages.
+  constexpr size_t writeBufferSize = 1 << 20;
+  constexpr size_t writeBufferAlignment = 4096;
+  // Longest a recorded frame waits in memory before it is written.
+  constexpr auto flushInterval = seconds(1);
+  // How long after its end a clip still accepts frames still being encoded.
+  constexpr int64_t clipGraceUs = 1000000;
+
+  int64_t wallClockUs()
+  {
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  }
+
+  bool writeAll(int fd, const void *data, size_t size)
+  {
+    auto *bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+      ssize_t n = ::write(fd, bytes, size);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      bytes += n;
+      size -= n;
+    }
+    return true;
+  }
+}
+
+struct RecordingEngine::CameraRecording
+{
+  shared_ptr<CameraConfig> camera;
+  unique_ptr<JpegSubscription> subscription;
+  // Clips are a single file named after their trigger time and ending at
+  // clipEndUs; they don't appear in the segment catalog.
+  bool isClip = false;
+  string clipName;
+  int64_t clipEndUs = 0;
+  // Guarded by queueMutex. Set once the close job is queued; frames that
+  // arrive later are dropped, so nothing reopens a segment after the close.
+  bool closing = false;
+
+  // Everything below is only touched by the writer thread.
+  int dataFd = -1;
+  int indexFd = -1;
+  int64_t segmentStartUs = 0;
+  int64_t lastTimeUs = 0;
+  // Segment size including what is still buffered.
+  uint64_t segmentBytes = 0;
+  uint32_t segmentFrames = 0;
+  // Size of the previous segment, preallocated for the next one.
+  uint64_t previousSegmentBytes = 0;
+  uint64_t preallocatedBytes = 0;
+  char *buffer = nullptr;
+  size_t buffered = 0;
+  vector<SegmentIndexEntry> pendingIndex;
+  uint64_t lastSeq = 0;
+  bool listed = false;
+
+  CameraRecording()
+  {
+    if (posix_memalign(reinterpret_cast<void **>(&buffer), writeBufferAlignment, writeBufferSize) != 0)
+      throw bad_alloc();
+  }
+
+  ~CameraRecording() { free(buffer); }
+};
+
+RecordingEngine::RecordingEngine(string root, seconds segmentDuration, size_t maxQueuedBytes)
+    : root(move(root)), segmentDurationUs(duration_cast<microseconds>(segmentDuration).count()),
+      maxQueuedBytes(maxQueuedBytes)
+{
+  loadCatalog();
+  writer = thread(&RecordingEngine::writerLoop, this);
+}
+
+RecordingEngine::~RecordingEngine()
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+  }
+  queueChanged.notify_all();
+  writer.join();
+}
+
+void RecordingEngine::startRecording(shared_ptr<CameraConfig> camera, JpegEncoderPool &encoder)
+{
+  auto recording = make_shared<CameraRecording>();
+  recording->camera = camera;
+  // Keeps the camera encoding while nobody is watching it live.
+  recording->subscription = make_unique<JpegSubscription>(encoder, camera);
+
+  lock_guard<mutex> lock(recordingsMutex);
+  recordings[camera->id] = move(recording);
+}
+
+void RecordingEngine::stopRecording(int cameraId)
+{
+  shared_ptr<CameraRecording> recording;
+  {
+    lock_guard<mutex> lock(recordingsMutex);
+    auto it = recordings.find(cameraId);
+    if (it == recordings.end())
+      return;
+    recording = move(it->second);
+    recordings.erase(it);
+  }
+  recording->subscription.reset();
+
+  {
+    lock_guard<mutex> lock(queueMutex);
+    recording->closing = true;
+    queue.push_back({move(recording), nullptr});
+  }
+  queueChanged.notify_one();
+}
+
+string RecordingEngine::startClip(shared_ptr<CameraConfig> camera, const vector<shared_ptr<const EncodedFrame>> &preEvent,
+                                  seconds postEvent, JpegEncoderPool &encoder)
+{
+  auto clip = make_shared<CameraRecording>();
+  int64_t triggerUs = wallClockUs();
+  clip->camera = camera;
+  clip->isClip = true;
+  clip->clipName = to_string(triggerUs);
+  clip->clipEndUs = triggerUs + duration_cast<microseconds>(postEvent).count();
+  if (postEvent.count() > 0)
+  {
+    clip->subscription = make_unique<JpegSubscription>(encoder, camera);
+  }
+
+  {
+    // Pre-event frames are queued ahead of any live frame for the clip, and
+    // regardless of the queue limit: they are already held in memory.
+    lock_guard<mutex> lock(queueMutex);
+    for (auto &frame : preEvent)
+    {
+      queue.push_back({clip, frame});
+      queuedBytes += frame->jpeg.size();
+    }
+    if (postEvent.count() > 0)
+    {
+      lock_guard<mutex> recordingsLock(recordingsMutex);
+      clips.push_back(clip);
+      clipCount++;
+    }
+    else
+    {
+      clip->closing = true;
+      queue.push_back({clip, nullptr});
+    }
+  }
+  queueChanged.notify_one();
+
+  return (fs::path(root) / to_string(camera->id) / "clips" / clip->clipName).string();
+}
+
+bool RecordingEngine::enqueue(shared_ptr<CameraRecording> recording, shared_ptr<const EncodedFrame> frame)
+{
+  size_t size = frame->jpeg.size();
+  {
+    lock_guard<mutex> lock(queueMutex);
+    // Stopped after frameEncoded looked it up; not a dropped frame.
+    if (recording->closing)
+      return true;
+    if (queuedBytes + size > maxQueuedBytes)
+      return false;
+    queue.push_back({move(recording), move(frame)});
+    queuedBytes += size;
+  }
+  queueChanged.notify_one();
+  return true;
+}
+
+void RecordingEngine::frameEncoded(CameraConfig &camera, const shared_ptr<const EncodedFrame> &frame)
+{
+  if (!camera.record && clipCount.load(memory_order_relaxed) == 0)
+    return;
+
+  shared_ptr<CameraRecording> recording;
+  vector<shared_ptr<CameraRecording>> cameraClips;
+  {
+    lock_guard<mutex> lock(recordingsMutex);
+    auto it = recordings.find(camera.id);
+    if (it != recordings.end())
+      recording = it->second;
+    for (auto &clip : clips)
+    {
+      if (clip->camera.get() == &camera)
+        cameraClips.push_back(clip);
+    }
+  }
+
+  if (recording && !enqueue(move(recording), frame))
+    camera.metrics.recordDropped.add();
+  for (auto &clip : cameraClips)
+  {
+    if (!enqueue(move(clip), frame))
+      camera.metrics.recordDropped.add();
+  }
+}
+
+string utcDayName(int64_t timeUs)
+{
+  time_t seconds = timeUs / 1000000 - (timeUs % 1000000 < 0 ? 1 : 0);
+  tm utc;
+  gmtime_r(&seconds, &utc);
+  char name[16];
+  strftime(name, sizeof(name), "%Y-%m-%d", &utc);
+  return name;
+}
+
+vector<RecordedSegment> RecordingEngine::listSegments(int cameraId)
+{
+  lock_guard<mutex> lock(catalogMutex);
+  auto it = catalog.find(cameraId);
+  if (it == catalog.end())
+    return {};
+  return {it->second.segments.begin(), it->second.segments.end()};
+}
+
+uint64_t RecordingEngine::getUsedBytes()
+{
+  lock_guard<mutex> lock(catalogMutex);
+  return catalogBytes;
+}
+
+uint64_t RecordingEngine::getCameraBytes(int cameraId)
+{
+  lock_guard<mutex> lock(catalogMutex);
+  auto it = catalog.find(cameraId);
+  return it == catalog.end() ? 0 : it->second.bytes;
+}
+
+vector<pair<int, uint64_t>> RecordingEngine::getCameraUsage()
+{
+  lock_guard<mutex> lock(catalogMutex);
+  vector<pair<int, uint64_t>> usage;
+  for (auto &[id, cameraCatalog] : catalog)
+  {
+    usage.emplace_back(id, cameraCatalog.bytes);
+  }
+  return usage;
+}
+
+void RecordingEngine::addThumbnailBytes(int cameraId, const string &day, uint64_t bytes)
+{
+  lock_guard<mutex> lock(catalogMutex);
+  auto &cameraCatalog = catalog[cameraId];
+  cameraCatalog.thumbnailPacks[day] += bytes;
+  cameraCatalog.bytes += bytes;
+  catalogBytes += bytes;
+}
+
+optional<EvictedSegment> RecordingEngine::evictOldest(int cameraId)
+{
+  lock_guard<mutex> lock(catalogMutex);
+  if (cameraId < 0)
+  {
+    if (oldestSegments.empty())
+      return nullopt;
+    cameraId = oldestSegments.begin()->second;
+  }
+
+  auto it = catalog.find(cameraId);
+  if (it == catalog.end() || it->second.segments.empty() || it->second.segments.front().open)
+    return nullopt;
+
+  CameraCatalog &cameraCatalog = it->second;
+  EvictedSegment evicted;
+  RecordedSegment &segment = evicted.segment;
+  segment = move(cameraCatalog.segments.front());
+  cameraCatalog.segments.pop_front();
+  cameraCatalog.bytes -= segment.bytes;
+  catalogBytes -= segment.bytes;
+  oldestSegments.erase({segment.startUs, cameraId});
+  if (!cameraCatalog.segments.empty())
+    oldestSegments.emplace(cameraCatalog.segments.front().startUs, cameraId);
+
+  // Packs of days before the oldest remaining segment's, or all of them if
+  // none remains, have no recording left to scrub. A recording camera always
+  // keeps its open segment, so this never takes the pack being written.
+  auto &packs = cameraCatalog.thumbnailPacks;
+  auto end = cameraCatalog.segments.empty() ? packs.end()
+                                            : packs.lower_bound(utcDayName(cameraCatalog.segments.front().startUs));
+  fs::path packDir = fs::path(root) / to_string(cameraId) / "thumbnails";
+  for (auto pack = packs.begin(); pack != end;)
+  {
+    evicted.thumbnailPacks.push_back((packDir / pack->first).string());
+    evicted.thumbnailBytes += pack->second;
+    pack = packs.erase(pack);
+  }
+  cameraCatalog.bytes -= evicted.thumbnailBytes;
+  catalogBytes -= evicted.thumbnailBytes;
+  return evicted;
+}
+
+// Reads the segments every camera left on disk, once at startup; from then
+// on the catalog is kept up to date as segments are written and evicted.
+void RecordingEngine::loadCatalog()
+{
+  error_code error;
+  for (auto &cameraDir : fs::directory_iterator(root, error))
+  {
+    int cameraId;
+    try
+    {
+      cameraId = stoi(cameraDir.path().filename().string());
+    }
+    catch (exception &)
+    {
+      continue;
+    }
+
+    auto &cameraCatalog = catalog[cameraId];
+    error_code dirError;
+    for (auto &file : fs::directory_iterator(cameraDir.path(), dirError))
+    {
+      if (file.path().extension() != ".idx")
+        continue;
+
+      RecordedSegment segment{};
+      try
+      {
+        segment.startUs = stoll(file.path().stem().string());
+      }
+      catch (exception &)
+      {
+        continue;
+      }
+      segment.indexPath = file.path().string();
+      segment.dataPath = fs::path(file.path()).replace_extension(".mjpeg").string();
+
+      int fd = ::open(segment.indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      struct stat info;
+      SegmentIndexEntry last;
+      // A crash can leave a partial entry at the end; it is ignored.
+      if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(last))
+      {
+        segment.frames = info.st_size / sizeof(last);
+        if (pread(fd, &last, sizeof(last), (off_t)(segment.frames - 1) * sizeof(last)) == sizeof(last))
+        {
+          segment.endUs = last.timeUs;
+          segment.bytes = last.offset + last.size;
+          cameraCatalog.bytes += segment.bytes;
+          cameraCatalog.segments.push_back(segment);
+        }
+      }
+      ::close(fd);
+    }
+
+    for (auto &file : fs::directory_iterator(cameraDir.path() / "thumbnails", dirError))
+    {
+      if (file.path().extension() != ".pack")
+        continue;
+      error_code sizeError;
+      uint64_t bytes = file.file_size(sizeError);
+      bytes += fs::file_size(fs::path(file.path()).replace_extension(".idx"), sizeError);
+      if (sizeError)
+        continue;
+      cameraCatalog.thumbnailPacks[file.path().stem().string()] = bytes;
+      cameraCatalog.bytes += bytes;
+    }
+
+    auto &segments = cameraCatalog.segments;
+    sort(segments.begin(), segments.end(), [](const RecordedSegment &a, const RecordedSegment &b)
+         { return a.startUs < b.startUs; });
+    catalogBytes += cameraCatalog.bytes;
+    if (!segments.empty())
+      oldestSegments.emplace(segments.front().startUs, cameraId);
+  }
+}
+
+void RecordingEngine::writerLoop()
+{
+  setTraceThreadName("recorder");
+
+  // Recordings with an open segment, for the periodic flush.
+  vector<shared_ptr<CameraRecording>> writing;
+  auto nextFlush = steady_clock::now() + flushInterval;
+
+  unique_lock<mutex> lock(queueMutex);
+  while (true)
+  {
+    if (queue.empty())
+    {
+      if (stopping)
+        break;
+      queueChanged.wait_until(lock, nextFlush);
+    }
+
+    if (!queue.empty())
+    {
+      WriteJob job = move(queue.front());
+      queue.pop_front();
+      if (job.frame)
+        queuedBytes -= job.frame->jpeg.size();
+      lock.unlock();
+
+      CameraRecording &recording = *job.recording;
+      if (job.frame)
+      {
+        writeFrame(recording, *job.frame);
+        if (!recording.listed)
+        {
+          recording.listed = true;
+          writing.push_back(job.recording);
+        }
+      }
+      else
+      {
+        closeSegment(recording);
+        writing.erase(remove(writing.begin(), writing.end(), job.recording), writing.end());
+      }
+
+      lock.lock();
+    }
+
+    if (steady_clock::now() >= nextFlush)
+    {
+      lock.unlock();
+      for (auto &recording : writing)
+      {
+        flushSegment(*recording);
+      }
+
+      vector<shared_ptr<CameraRecording>> finished;
+      {
+        lock_guard<mutex> recordingsLock(recordingsMutex);
+        int64_t nowUs = wallClockUs();
+        auto done = stable_partition(clips.begin(), clips.end(), [&](const shared_ptr<CameraRecording> &clip)
+                                     { return clip->clipEndUs + clipGraceUs > nowUs; });
+        finished.assign(done, clips.end());
+        clips.erase(done, clips.end());
+        clipCount -= finished.size();
+      }
+      for (auto &clip : finished)
+      {
+        clip->subscription.reset();
+      }
+
+      lock.lock();
+      // Behind any of the clip's frames that are still queued.
+      for (auto &clip : finished)
+      {
+        clip->closing = true;
+        queue.push_back({clip, nullptr});
+      }
+      nextFlush = steady_clock::now() + flushInterval;
+    }
+  }
+  lock.unlock();
+
+  for (auto &recording : writing)
+  {
+    closeSegment(*recording);
+  }
+}
+
+void RecordingEngine::writeFrame(CameraRecording &recording, const EncodedFrame &frame)
+{
+  TraceSpan span("record", recording.camera->id);
+  int64_t timeUs = frame.info.captureTimeUs;
+  // A clip sees its pre-event frames and the live ones queued around the
+  // trigger; never write a frame twice.
+  if (frame.info.seq <= recording.lastSeq)
+    return;
+  if (recording.isClip)
+  {
+    if (timeUs > recording.clipEndUs || (recording.dataFd >= 0 && timeUs < recording.lastTimeUs))
+      return;
+  }
+  // A wall-clock step backwards also starts a new segment, so every index
+  // stays sorted by time.
+  else if (recording.dataFd >= 0 &&
+           (timeUs - recording.segmentStartUs >= segmentDurationUs || timeUs < recording.lastTimeUs))
+  {
+    closeSegment(recording);
+  }
+
+  if (recording.dataFd < 0)
+  {
+    openSegment(recording, timeUs);
+    if (recording.dataFd < 0)
+      return;
+  }
+
+  SegmentIndexEntry entry{timeUs, recording.segmentBytes, (uint32_t)frame.jpeg.size(),
+                          frame.keyframe ? segmentKeyframe : 0};
+
+  const uchar *data = frame.jpeg.data();
+  size_t left = frame.jpeg.size();
+  while (left > 0)
+  {
+    size_t n = min(left, writeBufferSize - recording.buffered);
+    memcpy(recording.buffer + recording.buffered, data, n);
+    recording.buffered += n;
+    data += n;
+    left -= n;
+    if (recording.buffered == writeBufferSize)
+    {
+      if (!writeAll(recording.dataFd, recording.buffer, recording.buffered))
+      {
+        LOG_RATE_LIMITED(LogLevel::Error, 1, "Recording camera %d: write failed: %s", recording.camera->id,
+                         strerror(errno));
+        // Drop the segment rather than leave an index pointing at lost data.
+        recording.buffered = 0;
+        recording.pendingIndex.clear();
+        closeSegment(recording);
+        return;
+      }
+      recording.buffered = 0;
+    }
+  }
+
+  recording.pendingIndex.push_back(entry);
+  recording.segmentBytes += entry.size;
+  recording.segmentFrames++;
+  recording.lastTimeUs = timeUs;
+  recording.lastSeq = frame.info.seq;
+  recording.camera->metrics.framesRecorded.add();
+  recording.camera->metrics.bytesRecorded.add(entry.size);
+}
+
+void RecordingEngine::openSegment(CameraRecording &recording, int64_t startUs)
+{
+  int cameraId = recording.camera->id;
+  fs::path dir = fs::path(root) / to_string(cameraId);
+  if (recording.isClip)
+    dir /= "clips";
+  error_code error;
+  fs::create_directories(dir, error);
+
+  string name = recording.isClip ? recording.clipName : to_string(startUs);
+  RecordedSegment segment{startUs, startUs, 0, 0, (dir / (name + ".mjpeg")).string(), (dir / (name + ".idx")).string(),
+                          true};
+  recording.dataFd = ::open(segment.dataPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  recording.indexFd = ::open(segment.indexPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (recording.dataFd < 0 || recording.indexFd < 0)
+  {
+    LOG_RATE_LIMITED(LogLevel::Error, 1, "Recording camera %d: cannot create %s: %s", cameraId,
+                     segment.dataPath.c_str(), strerror(errno));
+    closeSegment(recording);
+    return;
+  }
+
+  recording.segmentStartUs = startUs;
+  recording.lastTimeUs = startUs;
+  recording.segmentBytes = 0;
+  recording.segmentFrames = 0;
+  recording.preallocatedBytes = 0;
+  if (recording.isClip)
+    return;
+
+  // Reserve about as much as the last segment took so the file gets
+  // contiguous extents instead of growing a megabyte at a time. Filesystems
+  // without fallocate() just skip this.
+  uint64_t expected = recording.previousSegmentBytes + recording.previousSegmentBytes / 8;
+  if (expected > 0 && fallocate(recording.dataFd, FALLOC_FL_KEEP_SIZE, 0, expected) == 0)
+    recording.preallocatedBytes = expected;
+
+  lock_guard<mutex> lock(catalogMutex);
+  auto &segments = catalog[cameraId].segments;
+  if (segments.empty())
+    oldestSegments.emplace(startUs, cameraId);
+  segments.push_back(move(segment));
+}
+
+void RecordingEngine::flushSegment(CameraRecording &recording)
+{
+  if (recording.dataFd < 0 || recording.pendingIndex.empty())
+    return;
+
+  bool ok = writeAll(recording.dataFd, recording.buffer, recording.buffered) &&
+            writeAll(recording.indexFd, recording.pendingIndex.data(),
+                     recording.pendingIndex.size() * sizeof(SegmentIndexEntry));
+  if (!ok)
+  {
+    LOG_RATE_LIMITED(LogLevel::Error, 1, "Recording camera %d: write failed: %s", recording.camera->id,
+                     strerror(errno));
+    recording.buffered = 0;
+    recording.pendingIndex.clear();
+    closeSegment(recording);
+    return;
+  }
+  recording.buffered = 0;
+
+  int64_t endUs = recording.pendingIndex.back().timeUs;
+  recording.pendingIndex.clear();
+  if (recording.isClip)
+    return;
+
+  lock_guard<mutex> lock(catalogMutex);
+  auto &cameraCatalog = catalog[recording.camera->id];
+  auto &segments = cameraCatalog.segments;
+  if (!segments.empty() && segments.back().open && segments.back().startUs == recording.segmentStartUs)
+  {
+    uint64_t added = recording.segmentBytes - segments.back().bytes;
+    cameraCatalog.bytes += added;
+    catalogBytes += added;
+    segments.back().endUs = endUs;
+    segments.back().bytes = recording.segmentBytes;
+    segments.back().frames = recording.segmentFrames;
+  }
+}
+
+void RecordingEngine::closeSegment(CameraRecording &recording)
+{
+  flushSegment(recording);
+  // Give back the part of the preallocation the segment didn't use.
+  if (recording.dataFd >= 0 && recording.preallocatedBytes > recording.segmentBytes)
+  {
+    fallocate(recording.dataFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, recording.segmentBytes,
+              recording.preallocatedBytes - recording.segmentBytes);
+  }
+  if (recording.dataFd >= 0)
+    ::close(recording.dataFd);
+  if (recording.indexFd >= 0)
+    ::close(recording.indexFd);
+  bool wasOpen = recording.dataFd >= 0 || recording.indexFd >= 0;
+  recording.dataFd = -1;
+  recording.indexFd = -1;
+  if (!wasOpen || recording.isClip)
+    return;
+  recording.previousSegmentBytes = recording.segmentBytes;
+
+  lock_guard<mutex> lock(catalogMutex);
+  auto &segments = catalog[recording.camera->id].segments;
+  if (!segments.empty() && segments.back().open && segments.back().startUs == recording.segmentStartUs)
+  {
+    segments.back().open = false;
+  }
+}
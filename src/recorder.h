@@ -0,0 +1,158 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "encoder.h"
+
+// One entry per frame in a segment's .idx file. Entries are fixed-size and
+// appended in time order, so an index can be mapped and binary-searched.
+struct SegmentIndexEntry
+{
+  int64_t timeUs;
+  uint64_t offset;
+  uint32_t size;
+  uint32_t flags;
+};
+static_assert(sizeof(SegmentIndexEntry) == 24, "index entries are read straight from disk");
+
+// The frame can be decoded without any earlier frame.
+constexpr uint32_t segmentKeyframe = 1;
+
+struct RecordedSegment
+{
+  int64_t startUs;
+  int64_t endUs;
+  uint64_t bytes;
+  uint32_t frames;
+  std::string dataPath;
+  std::string indexPath;
+  // Still being written.
+  bool open;
+};
+
+// A segment taken out of the catalog, with the thumbnail packs of days no
+// remaining segment of its camera covers. Paths are without extension.
+struct EvictedSegment
+{
+  RecordedSegment segment;
+  std::vector<std::string> thumbnailPacks;
+  uint64_t thumbnailBytes = 0;
+};
+
+// Name (YYYY-MM-DD) of the UTC day `timeUs` falls on, as used for
+// thumbnail packs.
+std::string utcDayName(int64_t timeUs);
+
+// Continuously records cameras into fixed-duration segment files under
+// <root>/<camera id>/: <start us>.mjpeg holds the encoded frames back to back
+// (the JPEGs the live stream already produced, so nothing is re-encoded) and
+// <start us>.idx their SegmentIndexEntry records. Event clips use the same
+// format under <root>/<camera id>/clips/.
+//
+// The encoder thread only queues a reference to each frame. A single I/O
+// thread copies frames into large page-aligned buffers and writes them out
+// when a buffer fills or once a second, so a slow disk shows up as dropped
+// recorded frames (bounded queue) rather than as stalls in capture or
+// encoding. Index entries are written after the data they point at.
+//
+// The segment catalog is read from disk once at startup and then tracks
+// sizes as frames are flushed, so disk usage is known without rescanning;
+// RetentionManager uses it to evict the oldest segments. Thumbnail packs are
+// counted too and leave with the last segment covering their day.
+class RecordingEngine : public EncodedFrameListener
+{
+private:
+  struct CameraRecording;
+  struct WriteJob
+  {
+    std::shared_ptr<CameraRecording> recording;
+    // Null closes the recording's segment.
+    std::shared_ptr<const EncodedFrame> frame;
+  };
+
+  std::string root;
+  int64_t segmentDurationUs;
+  size_t maxQueuedBytes;
+
+  std::mutex recordingsMutex;
+  std::map<int, std::shared_ptr<CameraRecording>> recordings;
+  // Clips still waiting for frames after their trigger.
+  std::vector<std::shared_ptr<CameraRecording>> clips;
+  std::atomic<int> clipCount{0};
+
+  // Each camera's segments oldest first and its thumbnail pack bytes by
+  // day, with their total size.
+  struct CameraCatalog
+  {
+    std::deque<RecordedSegment> segments;
+    std::map<std::string, uint64_t> thumbnailPacks;
+    uint64_t bytes = 0;
+  };
+
+  std::mutex catalogMutex;
+  std::map<int, CameraCatalog> catalog;
+  uint64_t catalogBytes = 0;
+  // (start, camera) of each camera's oldest segment, so the oldest one
+  // overall is found and replaced in O(log cameras), independent of the
+  // number of segments.
+  std::set<std::pair<int64_t, int>> oldestSegments;
+
+  std::mutex queueMutex;
+  std::condition_variable queueChanged;
+  std::deque<WriteJob> queue;
+  size_t queuedBytes = 0;
+  bool stopping = false;
+  std::thread writer;
+
+  void writerLoop();
+  bool enqueue(std::shared_ptr<CameraRecording> recording, std::shared_ptr<const EncodedFrame> frame);
+  void writeFrame(CameraRecording &recording, const EncodedFrame &frame);
+  void openSegment(CameraRecording &recording, int64_t startUs);
+  void flushSegment(CameraRecording &recording);
+  void closeSegment(CameraRecording &recording);
+  void loadCatalog();
+
+public:
+  RecordingEngine(std::string root, std::chrono::seconds segmentDuration, size_t maxQueuedBytes);
+  ~RecordingEngine();
+
+  const std::string &getRoot() const { return root; }
+
+  void startRecording(std::shared_ptr<CameraConfig> camera, JpegEncoderPool &encoder);
+  void stopRecording(int cameraId);
+
+  // Writes `preEvent` followed by the camera's live frames for `postEvent`
+  // into one clip file. Returns the clip's path (without extension).
+  std::string startClip(std::shared_ptr<CameraConfig> camera, const std::vector<std::shared_ptr<const EncodedFrame>> &preEvent,
+                        std::chrono::seconds postEvent, JpegEncoderPool &encoder);
+
+  void frameEncoded(CameraConfig &camera, const std::shared_ptr<const EncodedFrame> &frame) override;
+
+  // Oldest first; includes segments from earlier runs.
+  std::vector<RecordedSegment> listSegments(int cameraId);
+
+  // Bytes of all recorded segments, kept up to date as they are written.
+  uint64_t getUsedBytes();
+  uint64_t getCameraBytes(int cameraId);
+  // Bytes per camera id, including cameras that were removed since.
+  std::vector<std::pair<int, uint64_t>> getCameraUsage();
+
+  // Counts bytes appended to a camera's thumbnail pack of `day` (utcDayName).
+  void addThumbnailBytes(int cameraId, const std::string &day, uint64_t bytes);
+
+  // Takes the oldest finished segment of `cameraId`, or of all cameras for
+  // -1, out of the catalog and returns it so the caller can delete its
+  // files. Nothing is returned if that segment is still being written.
+  std::optional<EvictedSegment> evictOldest(int cameraId = -1);
+};
@@ -0,0 +1,110 @@
+#include "retention.h"
+
+#include <cstdio>
+#include <sys/statvfs.h>
+#include "logger.h"
+#include "thread_tuning.h"
+#include "trace.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  // Usage is checked this often; a segment flushes about once a second, so
+  // checking faster would find nothing new.
+  constexpr auto checkInterval = seconds(1);
+  constexpr int maxFreeSpaceEvictions = 16;
+}
+
+RetentionManager::RetentionManager(RecordingEngine &recorder, RetentionLimits limits)
+    : recorder(recorder), limits(limits)
+{
+  worker = thread(&RetentionManager::workerLoop, this);
+}
+
+RetentionManager::~RetentionManager()
+{
+  {
+    lock_guard<mutex> lock(stateMutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  worker.join();
+}
+
+bool RetentionManager::lowOnSpace() const
+{
+  if (limits.minFreePercent <= 0)
+    return false;
+  struct statvfs info;
+  if (statvfs(recorder.getRoot().c_str(), &info) != 0 || info.f_blocks == 0)
+    return false;
+  return info.f_bavail * 100 < (uint64_t)limits.minFreePercent * info.f_blocks;
+}
+
+bool RetentionManager::evict(int cameraId)
+{
+  auto evicted = recorder.evictOldest(cameraId);
+  if (!evicted)
+    return false;
+
+  TraceSpan span("evict", cameraId);
+  const RecordedSegment &segment = evicted->segment;
+  // Playback that still has the files open keeps reading until it closes them.
+  remove(segment.indexPath.c_str());
+  remove(segment.dataPath.c_str());
+  for (auto &pack : evicted->thumbnailPacks)
+  {
+    remove((pack + ".idx").c_str());
+    remove((pack + ".pack").c_str());
+  }
+  evictedSegments++;
+  evictedBytes += segment.bytes + evicted->thumbnailBytes;
+  LOG_DEBUG("Evicted segment %lld of camera %d (%llu bytes) and %zu thumbnail packs", (long long)segment.startUs,
+            cameraId, (unsigned long long)segment.bytes, evicted->thumbnailPacks.size());
+  return true;
+}
+
+void RetentionManager::workerLoop()
+{
+  applyThreadTuning(ThreadRole::Storage);
+  setTraceThreadName("retention");
+
+  unique_lock<mutex> lock(stateMutex);
+  while (!stopping)
+  {
+    lock.unlock();
+
+    if (limits.maxCameraBytes > 0)
+    {
+      for (auto &[cameraId, bytes] : recorder.getCameraUsage())
+      {
+        if (bytes <= limits.maxCameraBytes)
+          continue;
+        while (recorder.getCameraBytes(cameraId) > limits.maxCameraBytes)
+        {
+          if (!evict(cameraId))
+            break;
+        }
+      }
+    }
+    while (limits.maxTotalBytes > 0 && recorder.getUsedBytes() > limits.maxTotalBytes)
+    {
+      if (!evict(-1))
+        break;
+    }
+    // Space held by files someone still has open only comes back when they
+    // close them, so free-space eviction is paced instead of looping until
+    // statvfs() agrees.
+    for (int i = 0; i < maxFreeSpaceEvictions && lowOnSpace(); i++)
+    {
+      if (!evict(-1))
+        break;
+    }
+
+    lock.lock();
+    wake.wait_for(lock, checkInterval, [&]
+                  { return stopping; });
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "recorder.h"
+
+struct RetentionLimits
+{
+  // 0 disables a limit.
+  uint64_t maxTotalBytes = 0;
+  uint64_t maxCameraBytes = 0;
+  // Evict while the recordings filesystem has less free space than this.
+  int minFreePercent = 0;
+};
+
+// Keeps recordings within RetentionLimits by deleting the oldest finished
+// segments, overall or of the camera over its quota. Usage comes from the
+// recorder's running totals, so a check costs no directory scan; the thread
+// runs with ThreadRole::Storage tuning (idle CPU and I/O class by default)
+// so deleting large files never competes with capture or recording.
+class RetentionManager
+{
+private:
+  RecordingEngine &recorder;
+  RetentionLimits limits;
+
+  std::mutex stateMutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::atomic<uint64_t> evictedSegments{0};
+  std::atomic<uint64_t> evictedBytes{0};
+  std::thread worker;
+
+  void workerLoop();
+  bool lowOnSpace() const;
+  // Deletes one segment's files; false if nothing could be evicted.
+  bool evict(int cameraId);
+
+public:
+  RetentionManager(RecordingEngine &recorder, RetentionLimits limits);
+  ~RetentionManager();
+
+  const RetentionLimits &getLimits() const { return limits; }
+  uint64_t getEvictedSegments() const { return evictedSegments; }
+  uint64_t getEvictedBytes() const { return evictedBytes; }
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Monotonic counter split into cache-line-sized shards. Each thread always
+// increments the same shard, so threads that bump one counter concurrently
+// (e.g. every viewer of a camera adding to bytes sent) don't bounce a shared
+// cache line; reads sum the shards and are only needed when scraping.
+class ShardedCounter
+{
+public:
+  static constexpr int shardCount = 8;
+
+private:
+  struct alignas(64) Shard
+  {
+    std::atomic<uint64_t> value{0};
+  };
+
+  std::array<Shard, shardCount> shards;
+
+  static int shardIndex()
+  {
+    static std::atomic<int> nextThread{0};
+    thread_local int index = nextThread.fetch_add(1, std::memory_order_relaxed) % shardCount;
+    return index;
+  }
+
+public:
+  void add(uint64_t amount = 1)
+  {
+    shards[shardIndex()].value.fetch_add(amount, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const
+  {
+    uint64_t total = 0;
+    for (auto &shard : shards)
+    {
+      total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+};
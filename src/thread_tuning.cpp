@@ -0,0 +1,285 @@
+#include "thread_tuning.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "logger.h"
+
+using namespace std;
+
+namespace
+{
+  constexpr int roleCount = 4;
+  constexpr ThreadRole allRoles[] = {ThreadRole::Capture, ThreadRole::Encode, ThreadRole::Network, ThreadRole::Storage};
+
+  // ioprio_set(2) constants; glibc has no wrapper or header for them.
+  constexpr int ioprioWhoProcess = 1;
+  constexpr int ioprioClassShift = 13;
+  constexpr int ioprioClassIdle = 3;
+
+  // Nodes set_mempolicy() can be given; the kernel's own limit.
+  constexpr int maxNumaNodes = 1024;
+  constexpr size_t maskBits = 8 * sizeof(unsigned long);
+
+  ThreadTuning tunings[roleCount];
+  bool configured[roleCount] = {};
+  bool anyConfigured = false;
+  atomic<bool> warned[roleCount] = {};
+
+  cpu_set_t defaultCpus;
+  int defaultNice = 0;
+
+  const char *rolePrefix(ThreadRole role)
+  {
+    switch (role)
+    {
+    case ThreadRole::Capture:
+      return "CAPTURE";
+    case ThreadRole::Encode:
+      return "ENCODE";
+    case ThreadRole::Network:
+      return "NETWORK";
+    case ThreadRole::Storage:
+      return "STORAGE";
+    }
+    return "";
+  }
+
+  const char *envValue(ThreadRole role, const char *suffix)
+  {
+    string name = string(rolePrefix(role)) + "_" + suffix;
+    const char *value = getenv(name.c_str());
+    return value && *value ? value : nullptr;
+  }
+
+  vector<int> numaNodeCpus(int node)
+  {
+    ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+    string list;
+    if (!in || !getline(in, list))
+    {
+      throw invalid_argument("unknown NUMA node " + to_string(node));
+    }
+    return parseCpuList(list);
+  }
+
+  void parseSched(const string &value, ThreadTuning &tuning)
+  {
+    string policy = value.substr(0, value.find(':'));
+    int priority = value.find(':') == string::npos ? 0 : stoi(value.substr(value.find(':') + 1));
+
+    if (policy == "other")
+      tuning.schedPolicy = SCHED_OTHER;
+    else if (policy == "batch")
+      tuning.schedPolicy = SCHED_BATCH;
+    else if (policy == "idle")
+      tuning.schedPolicy = SCHED_IDLE;
+    else if (policy == "fifo")
+      tuning.schedPolicy = SCHED_FIFO;
+    else if (policy == "rr")
+      tuning.schedPolicy = SCHED_RR;
+    else
+      throw invalid_argument("unknown scheduling policy " + policy);
+
+    tuning.schedPriority = priority;
+    tuning.hasSched = true;
+  }
+
+  void warnOnce(ThreadRole role, const string &what)
+  {
+    if (!warned[(int)role].exchange(true))
+    {
+      LOG_WARNING("%s thread tuning: %s: %s", rolePrefix(role), what.c_str(), strerror(errno));
+    }
+  }
+
+  void setPreferredNode(int node)
+  {
+    if (node < 0)
+    {
+      syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+      return;
+    }
+    unsigned long mask[maxNumaNodes / maskBits] = {};
+    mask[node / maskBits] = 1UL << (node % maskBits);
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+  }
+}
+
+vector<int> parseCpuList(const string &list)
+{
+  vector<int> cpus;
+  stringstream ranges(list);
+  string range;
+  while (getline(ranges, range, ','))
+  {
+    if (range.empty())
+      continue;
+
+    size_t dash = range.find('-');
+    int first = stoi(range.substr(0, dash));
+    int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+    {
+      throw invalid_argument("bad cpu range " + range);
+    }
+    for (int cpu = first; cpu <= last; cpu++)
+    {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+void loadThreadTuning()
+{
+  sched_getaffinity(0, sizeof(defaultCpus), &defaultCpus);
+  defaultNice = getpriority(PRIO_PROCESS, 0);
+
+  for (auto role : allRoles)
+  {
+    ThreadTuning tuning;
+    if (role == ThreadRole::Storage)
+    {
+      // Housekeeping only runs when nothing else wants the CPU or the disk.
+      tuning.hasSched = true;
+      tuning.schedPolicy = SCHED_IDLE;
+      tuning.idleIo = true;
+    }
+    try
+    {
+      if (auto cpus = envValue(role, "CPUS"))
+      {
+        tuning.cpus = parseCpuList(cpus);
+      }
+      if (auto node = envValue(role, "NUMA_NODE"))
+      {
+        tuning.numaNode = stoi(node);
+        if (tuning.numaNode < 0 || tuning.numaNode >= maxNumaNodes)
+          throw invalid_argument("bad NUMA node " + string(node));
+        auto nodeCpus = numaNodeCpus(tuning.numaNode);
+        if (tuning.cpus.empty())
+        {
+          tuning.cpus = nodeCpus;
+        }
+        else
+        {
+          vector<int> both;
+          for (int cpu : tuning.cpus)
+          {
+            if (find(nodeCpus.begin(), nodeCpus.end(), cpu) != nodeCpus.end())
+              both.push_back(cpu);
+          }
+          // An empty set would silently mean the default placement.
+          if (both.empty())
+            throw invalid_argument("none of the CPUs are on NUMA node " + to_string(tuning.numaNode));
+          tuning.cpus = both;
+        }
+      }
+      if (auto nice = envValue(role, "NICE"))
+      {
+        tuning.nice = stoi(nice);
+        tuning.hasNice = true;
+      }
+      if (auto sched = envValue(role, "SCHED"))
+      {
+        parseSched(sched, tuning);
+      }
+      if (auto io = envValue(role, "IO"))
+      {
+        if (string(io) != "idle" && string(io) != "default")
+          throw invalid_argument("unknown I/O class " + string(io));
+        tuning.idleIo = string(io) == "idle";
+      }
+    }
+    catch (exception &e)
+    {
+      LOG_ERROR("Ignoring %s thread tuning: %s", rolePrefix(role), e.what());
+      continue;
+    }
+
+    bool isConfigured =
+        !tuning.cpus.empty() || tuning.numaNode >= 0 || tuning.hasNice || tuning.hasSched || tuning.idleIo;
+    tunings[(int)role] = tuning;
+    configured[(int)role] = isConfigured;
+    anyConfigured |= isConfigured;
+
+    if (isConfigured)
+    {
+      string summary = to_string(tuning.cpus.size()) + " cpus" +
+                       (tuning.numaNode >= 0 ? ", numa node " + to_string(tuning.numaNode) : "") +
+                       (tuning.hasNice ? ", nice " + to_string(tuning.nice) : "") +
+                       (tuning.hasSched ? ", sched policy " + to_string(tuning.schedPolicy) + "/" + to_string(tuning.schedPriority) : "") +
+                       (tuning.idleIo ? ", idle I/O" : "");
+      LOG_INFO("%s threads: %s", rolePrefix(role), summary.c_str());
+    }
+  }
+}
+
+void applyThreadTuning(ThreadRole role)
+{
+  if (!anyConfigured)
+  {
+    return;
+  }
+
+  const ThreadTuning &tuning = tunings[(int)role];
+  bool isConfigured = configured[(int)role];
+
+  cpu_set_t cpus = defaultCpus;
+  if (isConfigured && !tuning.cpus.empty())
+  {
+    CPU_ZERO(&cpus);
+    for (int cpu : tuning.cpus)
+    {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (error != 0)
+  {
+    errno = error;
+    warnOnce(role, "setting cpu affinity");
+  }
+
+  setPreferredNode(isConfigured ? tuning.numaNode : -1);
+
+  sched_param param{};
+  int policy = SCHED_OTHER;
+  if (isConfigured && tuning.hasSched)
+  {
+    policy = tuning.schedPolicy;
+    param.sched_priority = tuning.schedPriority;
+  }
+  error = pthread_setschedparam(pthread_self(), policy, &param);
+  if (error != 0)
+  {
+    errno = error;
+    warnOnce(role, "setting scheduling policy");
+  }
+
+  // On Linux nice is per thread when addressed by thread id.
+  int nice = isConfigured && tuning.hasNice ? tuning.nice : defaultNice;
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) != 0)
+  {
+    warnOnce(role, "setting nice value");
+  }
+
+  // Class 0 falls back to the I/O priority derived from the nice value.
+  int ioPriority = isConfigured && tuning.idleIo ? ioprioClassIdle << ioprioClassShift : 0;
+  if (syscall(SYS_ioprio_set, ioprioWhoProcess, syscall(SYS_gettid), ioPriority) != 0)
+  {
+    warnOnce(role, "setting I/O priority");
+  }
+}
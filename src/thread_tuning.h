@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+enum class ThreadRole
+{
+  Capture,
+  Encode,
+  Network,
+  // Background disk housekeeping; idle CPU and I/O priority unless
+  // configured otherwise.
+  Storage
+};
+
+// CPU placement and scheduling for one class of threads, read from
+// <ROLE>_CPUS (e.g. "0-7,16"), <ROLE>_NUMA_NODE, <ROLE>_NICE and
+// <ROLE>_SCHED ("other", "batch", "idle", "fifo:<prio>" or "rr:<prio>") and
+// <ROLE>_IO ("idle" or "default" I/O scheduling class).
+struct ThreadTuning
+{
+  std::vector<int> cpus;
+  int numaNode = -1;
+  bool hasNice = false;
+  int nice = 0;
+  bool hasSched = false;
+  int schedPolicy = 0;
+  int schedPriority = 0;
+  bool idleIo = false;
+};
+
+// Parses a Linux cpulist such as "0-3,8,10-11"; throws std::invalid_argument.
+std::vector<int> parseCpuList(const std::string &list);
+
+// Reads the tuning for every role from the environment. Call once at startup,
+// before any tuned thread is created.
+void loadThreadTuning();
+
+// Applies the role's tuning to the calling thread. Roles without settings
+// are reset to the process defaults, so a thread never keeps a placement it
+// inherited from a differently tuned parent (Linux threads inherit affinity,
+// nice and scheduling policy from their creator). Failures such as EPERM for
+// real-time policies are logged once and otherwise ignored.
+void applyThreadTuning(ThreadRole role);
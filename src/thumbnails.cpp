@@ -0,0 +1,357 @@
+#include "thumbnails.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "logger.h"
+#include "playback.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+namespace
+{
+  constexpr int64_t dayUs = 86400LL * 1000000;
+  // Thumbnails waiting for the worker; beyond this, due frames are skipped.
+  constexpr size_t maxQueuedThumbnails = 16;
+
+  int64_t floorDiv(int64_t value, int64_t divisor)
+  {
+    return value / divisor - (value % divisor < 0 ? 1 : 0);
+  }
+
+  bool writeAll(int fd, const void *data, size_t size)
+  {
+    auto *bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+      ssize_t n = ::write(fd, bytes, size);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      bytes += n;
+      size -= n;
+    }
+    return true;
+  }
+}
+
+struct ThumbnailTimeline::CameraTimeline
+{
+  shared_ptr<CameraConfig> camera;
+  // Capture time the next thumbnail is due at; only touched by the capture
+  // thread.
+  int64_t nextDueUs = 0;
+
+  // Only touched by the worker thread.
+  int dataFd = -1;
+  int indexFd = -1;
+  int64_t day = 0;
+  uint64_t dataBytes = 0;
+  int64_t lastTimeUs = 0;
+  // Set by the close job; a frame queued behind it must not reopen files
+  // nothing would close again.
+  bool closed = false;
+};
+
+ThumbnailTimeline::ThumbnailTimeline(RecordingEngine &recorder, seconds interval, int width, int quality)
+    : recorder(recorder), root(recorder.getRoot()), intervalUs(duration_cast<microseconds>(interval).count()), width(width), quality(quality)
+{
+  worker = thread(&ThumbnailTimeline::workerLoop, this);
+}
+
+ThumbnailTimeline::~ThumbnailTimeline()
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+  }
+  queueChanged.notify_all();
+  worker.join();
+}
+
+string ThumbnailTimeline::cameraDir(int cameraId) const
+{
+  return (fs::path(root) / to_string(cameraId) / "thumbnails").string();
+}
+
+void ThumbnailTimeline::startCamera(shared_ptr<CameraConfig> camera)
+{
+  auto timeline = make_shared<CameraTimeline>();
+  timeline->camera = camera;
+
+  lock_guard<mutex> lock(timelinesMutex);
+  timelines[camera->id] = move(timeline);
+}
+
+void ThumbnailTimeline::stopCamera(int cameraId)
+{
+  shared_ptr<CameraTimeline> timeline;
+  {
+    lock_guard<mutex> lock(timelinesMutex);
+    auto it = timelines.find(cameraId);
+    if (it == timelines.end())
+      return;
+    timeline = move(it->second);
+    timelines.erase(it);
+  }
+
+  {
+    lock_guard<mutex> lock(queueMutex);
+    queue.push_back({move(timeline), Mat(), 0});
+  }
+  queueChanged.notify_one();
+}
+
+void ThumbnailTimeline::frameCaptured(CameraConfig &camera, const Mat &frame, const FrameInfo &info)
+{
+  if (!camera.record || intervalUs <= 0)
+    return;
+
+  shared_ptr<CameraTimeline> timeline;
+  {
+    lock_guard<mutex> lock(timelinesMutex);
+    auto it = timelines.find(camera.id);
+    if (it == timelines.end())
+      return;
+    timeline = it->second;
+  }
+
+  int64_t timeUs = info.captureTimeUs;
+  // A clock step backwards restarts the schedule instead of pausing it.
+  if (timeUs < timeline->nextDueUs && timeline->nextDueUs - timeUs <= intervalUs)
+    return;
+  timeline->nextDueUs = timeUs + intervalUs;
+
+  {
+    lock_guard<mutex> lock(queueMutex);
+    if (queue.size() >= maxQueuedThumbnails)
+    {
+      camera.metrics.thumbnailDropped.add();
+      return;
+    }
+    queue.push_back({move(timeline), frame, timeUs});
+  }
+  queueChanged.notify_one();
+}
+
+void ThumbnailTimeline::workerLoop()
+{
+  setTraceThreadName("thumbnails");
+
+  unique_lock<mutex> lock(queueMutex);
+  while (true)
+  {
+    queueChanged.wait(lock, [&]
+                      { return stopping || !queue.empty(); });
+    if (queue.empty())
+      break;
+
+    Job job = move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+
+    if (job.frame.empty())
+    {
+      job.timeline->closed = true;
+      closeFiles(*job.timeline);
+    }
+    else
+      writeThumbnail(*job.timeline, job.frame, job.timeUs);
+    // Drop the reference to the full-size frame before waiting again.
+    job = {};
+
+    lock.lock();
+  }
+  lock.unlock();
+
+  lock_guard<mutex> timelinesLock(timelinesMutex);
+  for (auto &[id, timeline] : timelines)
+  {
+    closeFiles(*timeline);
+  }
+}
+
+void ThumbnailTimeline::writeThumbnail(CameraTimeline &timeline, const Mat &frame, int64_t timeUs)
+{
+  if (timeline.closed)
+    return;
+  int cameraId = timeline.camera->id;
+  TraceSpan span("thumbnail", cameraId);
+
+  // Each pack covers one UTC day; its index must stay sorted by time.
+  int64_t day = floorDiv(timeUs, dayUs);
+  if (timeline.dataFd >= 0 && day != timeline.day)
+    closeFiles(timeline);
+  if (timeline.dataFd >= 0 && timeUs < timeline.lastTimeUs)
+    return;
+
+  if (timeline.dataFd < 0)
+  {
+    error_code error;
+    fs::create_directories(cameraDir(cameraId), error);
+    string base = (fs::path(cameraDir(cameraId)) / utcDayName(day * dayUs)).string();
+    timeline.dataFd = ::open((base + ".pack").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    timeline.indexFd = ::open((base + ".idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat dataInfo, indexInfo;
+    if (timeline.dataFd < 0 || timeline.indexFd < 0 || fstat(timeline.dataFd, &dataInfo) != 0 ||
+        fstat(timeline.indexFd, &indexInfo) != 0)
+    {
+      LOG_RATE_LIMITED(LogLevel::Error, 1, "Thumbnails for camera %d: cannot open %s.pack: %s", cameraId, base.c_str(),
+                       strerror(errno));
+      closeFiles(timeline);
+      return;
+    }
+    timeline.day = day;
+    timeline.dataBytes = dataInfo.st_size;
+    // Appending to a pack from an earlier run: keep its index sorted, and
+    // drop a partial entry a crash may have left.
+    timeline.lastTimeUs = 0;
+    size_t entries = indexInfo.st_size / sizeof(SegmentIndexEntry);
+    SegmentIndexEntry last;
+    if (entries > 0 && pread(timeline.indexFd, &last, sizeof(last), (off_t)(entries - 1) * sizeof(last)) == sizeof(last))
+      timeline.lastTimeUs = last.timeUs;
+    if ((size_t)indexInfo.st_size != entries * sizeof(SegmentIndexEntry) &&
+        ftruncate(timeline.indexFd, entries * sizeof(SegmentIndexEntry)) != 0)
+    {
+      closeFiles(timeline);
+      return;
+    }
+    if (timeUs < timeline.lastTimeUs)
+      return;
+  }
+
+  Mat small;
+  int height = max(1, (int)lround((double)frame.rows * width / frame.cols));
+  resize(frame, small, Size(width, height), 0, 0, INTER_AREA);
+  vector<uchar> jpeg;
+  imencode(".jpg", small, jpeg, {IMWRITE_JPEG_QUALITY, quality});
+
+  SegmentIndexEntry entry{timeUs, timeline.dataBytes, (uint32_t)jpeg.size(), segmentKeyframe};
+  // Data before index, so an entry never points past the end of the pack.
+  if (!writeAll(timeline.dataFd, jpeg.data(), jpeg.size()) || !writeAll(timeline.indexFd, &entry, sizeof(entry)))
+  {
+    LOG_RATE_LIMITED(LogLevel::Error, 1, "Thumbnails for camera %d: write failed: %s", cameraId, strerror(errno));
+    // Reopening re-reads the pack size, so a partial write can't shift later offsets.
+    closeFiles(timeline);
+    return;
+  }
+  timeline.dataBytes += jpeg.size();
+  timeline.lastTimeUs = timeUs;
+  recorder.addThumbnailBytes(cameraId, utcDayName(timeUs), jpeg.size() + sizeof(entry));
+  timeline.camera->metrics.thumbnailsWritten.add();
+}
+
+void ThumbnailTimeline::closeFiles(CameraTimeline &timeline)
+{
+  if (timeline.dataFd >= 0)
+    ::close(timeline.dataFd);
+  if (timeline.indexFd >= 0)
+    ::close(timeline.indexFd);
+  timeline.dataFd = -1;
+  timeline.indexFd = -1;
+}
+
+ThumbnailBatch ThumbnailTimeline::read(int cameraId, int64_t fromUs, int64_t toUs, size_t limit)
+{
+  ThumbnailBatch batch;
+  if (toUs < fromUs || limit == 0)
+    return batch;
+
+  // Pack names sort like their days, so the range check works on names.
+  string first = utcDayName(fromUs);
+  string last = utcDayName(toUs);
+  vector<string> packs;
+  error_code error;
+  for (auto &file : fs::directory_iterator(cameraDir(cameraId), error))
+  {
+    string name = file.path().stem().string();
+    if (file.path().extension() == ".idx" && name >= first && name <= last)
+      packs.push_back(file.path().string());
+  }
+  sort(packs.begin(), packs.end());
+
+  struct Match
+  {
+    size_t pack;
+    SegmentIndexEntry entry;
+  };
+  vector<Match> matches;
+  for (size_t pack = 0; pack < packs.size(); pack++)
+  {
+    SegmentIndexMap index;
+    if (!index.open(packs[pack]))
+      continue;
+    size_t end = index.lowerBound(toUs + 1);
+    for (size_t i = index.lowerBound(fromUs); i < end; i++)
+    {
+      matches.push_back({pack, index[i]});
+    }
+  }
+
+  // Evenly spaced picks when the range holds more than asked for.
+  vector<Match> picked;
+  if (matches.size() > limit)
+  {
+    for (size_t i = 0; i < limit; i++)
+    {
+      picked.push_back(matches[i * matches.size() / limit]);
+    }
+  }
+  else
+  {
+    picked = move(matches);
+  }
+
+  // Thumbnails that are adjacent in a pack are read with one pread().
+  int dataFd = -1;
+  size_t openPack = SIZE_MAX;
+  for (size_t i = 0; i < picked.size();)
+  {
+    size_t runEnd = i + 1;
+    while (runEnd < picked.size() && picked[runEnd].pack == picked[i].pack &&
+           picked[runEnd].entry.offset == picked[runEnd - 1].entry.offset + picked[runEnd - 1].entry.size)
+    {
+      runEnd++;
+    }
+
+    if (picked[i].pack != openPack)
+    {
+      if (dataFd >= 0)
+        ::close(dataFd);
+      openPack = picked[i].pack;
+      dataFd = ::open(fs::path(packs[openPack]).replace_extension(".pack").c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    uint64_t runOffset = picked[i].entry.offset;
+    size_t runBytes = picked[runEnd - 1].entry.offset + picked[runEnd - 1].entry.size - runOffset;
+    size_t at = batch.data.size();
+    batch.data.resize(at + runBytes);
+    if (dataFd < 0 || pread(dataFd, &batch.data[at], runBytes, runOffset) != (ssize_t)runBytes)
+    {
+      batch.data.resize(at);
+      i = runEnd;
+      continue;
+    }
+    for (; i < runEnd; i++)
+    {
+      SegmentIndexEntry entry = picked[i].entry;
+      entry.offset = at + (entry.offset - runOffset);
+      batch.entries.push_back(entry);
+    }
+  }
+  if (dataFd >= 0)
+    ::close(dataFd);
+  return batch;
+}
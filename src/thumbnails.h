@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture.h"
+#include "recorder.h"
+
+// Thumbnails read back for one time range: `data` holds the JPEGs back to
+// back and each entry's offset points into it.
+struct ThumbnailBatch
+{
+  std::vector<SegmentIndexEntry> entries;
+  std::string data;
+};
+
+// Keeps a scrubbing timeline for recorded cameras: every `interval` one
+// captured frame is scaled down to `width` pixels and stored as a small JPEG
+// in a pack file per camera and UTC day, <root>/<camera id>/thumbnails/
+// <YYYY-MM-DD>.pack, with a .idx of SegmentIndexEntry records next to it.
+//
+// The capture thread only hands over a reference to the decoded frame;
+// scaling, encoding and writing happen on one background thread, and frames
+// are skipped rather than queued when it falls behind. Packs live in the
+// recorder's directories and count towards its catalog, so retention
+// deletes them along with the recordings of their day.
+class ThumbnailTimeline : public CapturedFrameListener
+{
+private:
+  struct CameraTimeline;
+  struct Job
+  {
+    std::shared_ptr<CameraTimeline> timeline;
+    // Empty closes the timeline's files.
+    cv::Mat frame;
+    int64_t timeUs;
+  };
+
+  RecordingEngine &recorder;
+  std::string root;
+  int64_t intervalUs;
+  int width;
+  int quality;
+
+  std::mutex timelinesMutex;
+  std::map<int, std::shared_ptr<CameraTimeline>> timelines;
+
+  std::mutex queueMutex;
+  std::condition_variable queueChanged;
+  std::deque<Job> queue;
+  bool stopping = false;
+  std::thread worker;
+
+  void workerLoop();
+  void writeThumbnail(CameraTimeline &timeline, const cv::Mat &frame, int64_t timeUs);
+  void closeFiles(CameraTimeline &timeline);
+  std::string cameraDir(int cameraId) const;
+
+public:
+  ThumbnailTimeline(RecordingEngine &recorder, std::chrono::seconds interval, int width, int quality);
+  ~ThumbnailTimeline();
+
+  void startCamera(std::shared_ptr<CameraConfig> camera);
+  void stopCamera(int cameraId);
+
+  void frameCaptured(CameraConfig &camera, const cv::Mat &frame, const FrameInfo &info) override;
+
+  // Thumbnails taken in [fromUs, toUs], at most `limit` of them spread evenly
+  // over the range.
+  ThumbnailBatch read(int cameraId, int64_t fromUs, int64_t toUs, size_t limit);
+};
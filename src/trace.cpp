@@ -0,0 +1,231 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace std::chrono;
+
+atomic<bool> traceEnabled{false};
+
+namespace
+{
+  // 512 KB per pipeline thread and 32 KB per connection thread at most;
+  // only allocated once a thread records its first span.
+  constexpr size_t pipelineRingCapacity = 16384;
+  constexpr size_t connectionRingCapacity = 1024;
+  constexpr auto maxCaptureDuration = seconds(30);
+
+  struct TraceEvent
+  {
+    const char *name;
+    int cameraId;
+    int64_t startNs;
+    int64_t endNs;
+  };
+
+  // Fields are atomic because captureTrace() copies slots while their thread
+  // may be overwriting them; it discards any slot that could be torn.
+  struct TraceSlot
+  {
+    atomic<const char *> name;
+    atomic<int> cameraId;
+    atomic<int64_t> startNs;
+    atomic<int64_t> endNs;
+  };
+
+  // Written only by its thread; `written` counts events ever written, so a
+  // reader can tell which slots were overwritten while it was copying.
+  struct TraceRing
+  {
+    explicit TraceRing(size_t capacity) : slots(make_unique<TraceSlot[]>(capacity)), capacity(capacity) {}
+
+    unique_ptr<TraceSlot[]> slots;
+    size_t capacity;
+    atomic<uint64_t> written{0};
+    atomic<bool> closed{false};
+    long thread = 0;
+    string name;
+    mutex nameMutex;
+  };
+
+  struct TraceState
+  {
+    mutex ringsMutex;
+    vector<shared_ptr<TraceRing>> rings;
+    mutex captureMutex;
+  };
+
+  TraceState &state()
+  {
+    static TraceState *instance = new TraceState;
+    return *instance;
+  }
+
+  struct ThreadTrace
+  {
+    shared_ptr<TraceRing> ring;
+    string pendingName;
+    TraceRingSize ringSize = TraceRingSize::Pipeline;
+
+    ~ThreadTrace()
+    {
+      if (ring)
+        ring->closed = true;
+    }
+  };
+
+  thread_local ThreadTrace threadTrace;
+
+  TraceRing &threadRing()
+  {
+    if (!threadTrace.ring)
+    {
+      auto ring = make_shared<TraceRing>(threadTrace.ringSize == TraceRingSize::Connection ? connectionRingCapacity
+                                                                                           : pipelineRingCapacity);
+      ring->thread = syscall(SYS_gettid);
+      ring->name = threadTrace.pendingName;
+      lock_guard<mutex> lock(state().ringsMutex);
+      state().rings.push_back(ring);
+      threadTrace.ring = move(ring);
+    }
+    return *threadTrace.ring;
+  }
+
+  void appendJsonString(string &out, const string &text)
+  {
+    out += '"';
+    for (char c : text)
+    {
+      if (c == '"' || c == '\\')
+        out += '\\';
+      if ((unsigned char)c >= 0x20)
+        out += c;
+    }
+    out += '"';
+  }
+}
+
+void setTraceThreadName(const string &name, TraceRingSize ringSize)
+{
+  // The kernel limits thread names to 15 characters.
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  threadTrace.pendingName = name;
+  threadTrace.ringSize = ringSize;
+  if (threadTrace.ring)
+  {
+    lock_guard<mutex> lock(threadTrace.ring->nameMutex);
+    threadTrace.ring->name = name;
+  }
+}
+
+void recordTraceSpan(const char *name, int cameraId, int64_t startNs, int64_t endNs)
+{
+  TraceRing &ring = threadRing();
+  uint64_t index = ring.written.load(memory_order_relaxed);
+  // Release stores (plain moves on x86): a reader that sees any of them
+  // also sees `written` at least at `index`.
+  TraceSlot &slot = ring.slots[index % ring.capacity];
+  slot.name.store(name, memory_order_release);
+  slot.cameraId.store(cameraId, memory_order_release);
+  slot.startNs.store(startNs, memory_order_release);
+  slot.endNs.store(endNs, memory_order_release);
+  ring.written.store(index + 1, memory_order_release);
+}
+
+string captureTrace(milliseconds duration)
+{
+  TraceState &trace = state();
+  lock_guard<mutex> captureLock(trace.captureMutex);
+
+  // Spans already sitting in the rings predate this capture.
+  int64_t fromNs = traceNowNs();
+  traceEnabled = true;
+  this_thread::sleep_for(min<milliseconds>(duration, maxCaptureDuration));
+  traceEnabled = false;
+  int64_t toNs = traceNowNs();
+
+  vector<shared_ptr<TraceRing>> rings;
+  {
+    lock_guard<mutex> lock(trace.ringsMutex);
+    rings = trace.rings;
+    // Threads that have exited won't record again; keep them until this
+    // capture has read their spans.
+    trace.rings.erase(remove_if(trace.rings.begin(), trace.rings.end(), [](const shared_ptr<TraceRing> &ring)
+                                { return ring->closed.load(); }),
+                      trace.rings.end());
+  }
+
+  string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  auto separator = [&]
+  {
+    if (!first)
+      out += ',';
+    first = false;
+  };
+  char line[256];
+  int pid = getpid();
+
+  for (auto &ring : rings)
+  {
+    size_t capacity = ring->capacity;
+    uint64_t end = ring->written.load(memory_order_acquire);
+    uint64_t begin = end > capacity ? end - capacity : 0;
+    vector<TraceEvent> events;
+    events.reserve(end - begin);
+    for (uint64_t i = begin; i < end; i++)
+    {
+      const TraceSlot &slot = ring->slots[i % capacity];
+      events.push_back({slot.name.load(memory_order_acquire), slot.cameraId.load(memory_order_acquire),
+                        slot.startNs.load(memory_order_acquire), slot.endNs.load(memory_order_acquire)});
+    }
+    // Spans ending after tracing was switched off may still be written;
+    // drop any slot the thread could have overwritten while we copied,
+    // including the one it may be writing right now (event `after`).
+    uint64_t after = ring->written.load(memory_order_acquire);
+    size_t overwritten = after + 1 > begin + capacity ? after + 1 - begin - capacity : 0;
+    events.erase(events.begin(), events.begin() + min(overwritten, events.size()));
+
+    bool any = false;
+    for (auto &event : events)
+    {
+      if (event.startNs < fromNs || event.startNs > toNs)
+        continue;
+      any = true;
+      separator();
+      snprintf(line, sizeof(line), "{\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"name\":", pid,
+               ring->thread, event.startNs / 1000.0, (event.endNs - event.startNs) / 1000.0);
+      out += line;
+      appendJsonString(out, event.name);
+      if (event.cameraId >= 0)
+        out += ",\"args\":{\"camera\":" + to_string(event.cameraId) + "}";
+      out += '}';
+    }
+
+    if (any)
+    {
+      string name;
+      {
+        lock_guard<mutex> lock(ring->nameMutex);
+        name = ring->name.empty() ? "thread " + to_string(ring->thread) : ring->name;
+      }
+      separator();
+      snprintf(line, sizeof(line), "{\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"name\":\"thread_name\",\"args\":{\"name\":", pid,
+               ring->thread);
+      out += line;
+      appendJsonString(out, name);
+      out += "}}";
+    }
+  }
+
+  out += "]}";
+  return out;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Per-stage tracing of the live pipeline. While a capture is running every
+// TraceSpan is written to its thread's own fixed-size ring buffer (no locks,
+// no allocation); captureTrace() collects the rings into Chrome trace-event
+// JSON, which opens directly in Perfetto or chrome://tracing. When no capture
+// is running a span costs one relaxed atomic load.
+
+extern std::atomic<bool> traceEnabled;
+
+// How many spans a thread's ring keeps. Pipeline threads serve every camera
+// and record many spans per frame; a thread serving one connection records
+// a span or two per frame sent and gets a ring a sixteenth the size, so
+// hundreds of viewers don't add up to hundreds of full-size rings.
+enum class TraceRingSize
+{
+  Pipeline,
+  Connection
+};
+
+// Names the calling thread for traces and for profilers (`perf`, `top -H`)
+// that read the kernel thread name. Call before the thread's first span for
+// `ringSize` to take effect.
+void setTraceThreadName(const std::string &name, TraceRingSize ringSize = TraceRingSize::Pipeline);
+
+void recordTraceSpan(const char *name, int cameraId, int64_t startNs, int64_t endNs);
+
+// Enables tracing for `duration`, then returns every span recorded in that
+// window as Chrome trace-event JSON. Concurrent calls are serialized.
+std::string captureTrace(std::chrono::milliseconds duration);
+
+inline int64_t traceNowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Records the enclosing scope as one span. `name` must be a string literal
+// (it is stored by pointer).
+class TraceSpan
+{
+private:
+  const char *name;
+  int cameraId;
+  int64_t startNs = 0;
+
+public:
+  explicit TraceSpan(const char *name, int cameraId = -1) : name(name), cameraId(cameraId)
+  {
+    if (traceEnabled.load(std::memory_order_relaxed))
+      startNs = traceNowNs();
+  }
+
+  ~TraceSpan()
+  {
+    if (startNs)
+      recordTraceSpan(name, cameraId, startNs, traceNowNs());
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+};
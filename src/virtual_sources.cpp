@@ -0,0 +1,221 @@
+#include "virtual_sources.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+using namespace cv;
+using namespace std;
+using namespace std::chrono;
+
+map<string, string> parseQueryParams(const string &url)
+{
+  map<string, string> params;
+  size_t query = url.find('?');
+  if (query == string::npos)
+  {
+    return params;
+  }
+
+  stringstream pairs(url.substr(query + 1));
+  string pair;
+  while (getline(pairs, pair, '&'))
+  {
+    size_t eq = pair.find('=');
+    if (eq == string::npos)
+    {
+      params[pair] = "";
+    }
+    else
+    {
+      params[pair.substr(0, eq)] = pair.substr(eq + 1);
+    }
+  }
+  return params;
+}
+
+namespace
+{
+  int intParam(const map<string, string> &params, const string &key, int fallback)
+  {
+    auto it = params.find(key);
+    return it == params.end() ? fallback : atoi(it->second.c_str());
+  }
+
+  string stringParam(const map<string, string> &params, const string &key, const string &fallback)
+  {
+    auto it = params.find(key);
+    return it == params.end() ? fallback : it->second;
+  }
+
+  Mat makeBackground(const string &pattern, int width, int height)
+  {
+    Mat background(height, width, CV_8UC3);
+    if (pattern == "gradient")
+    {
+      for (int y = 0; y < height; y++)
+      {
+        auto row = background.ptr<Vec3b>(y);
+        for (int x = 0; x < width; x++)
+        {
+          row[x] = Vec3b{(uchar)(x * 255 / width), (uchar)(y * 255 / height), (uchar)(255 - x * 255 / width)};
+        }
+      }
+      return background;
+    }
+
+    // SMPTE-style color bars.
+    static const Scalar bars[] = {{192, 192, 192}, {0, 192, 192}, {192, 192, 0}, {0, 192, 0},
+                                  {192, 0, 192}, {0, 0, 192}, {192, 0, 0}};
+    int barWidth = (width + 6) / 7;
+    for (int i = 0; i < 7; i++)
+    {
+      rectangle(background, Rect(i * barWidth, 0, barWidth, height), bars[i], FILLED);
+    }
+    return background;
+  }
+}
+
+SyntheticCapture::SyntheticCapture(const string &url) : startedAt(steady_clock::now())
+{
+  auto params = parseQueryParams(url);
+  width = intParam(params, "width", 1280);
+  height = intParam(params, "height", 720);
+  fps = max(1, intParam(params, "fps", 25));
+  pattern = stringParam(params, "pattern", "bars");
+  motion = stringParam(params, "motion", "box");
+
+  bool validPattern = pattern == "bars" || pattern == "gradient" || pattern == "noise";
+  bool validMotion = motion == "box" || motion == "pan" || motion == "none";
+  if (width < 16 || height < 16 || width > 7680 || height > 4320 || !validPattern || !validMotion)
+  {
+    return;
+  }
+
+  if (pattern != "noise")
+  {
+    background = makeBackground(pattern, width, height);
+  }
+  opened = true;
+}
+
+bool SyntheticCapture::grab()
+{
+  if (!opened)
+  {
+    return false;
+  }
+  frameIndex = (long long)(duration<double>(steady_clock::now() - startedAt).count() * fps);
+  return true;
+}
+
+bool SyntheticCapture::retrieve(OutputArray image, int)
+{
+  if (!opened || frameIndex < 0)
+  {
+    return false;
+  }
+  image.create(height, width, CV_8UC3);
+  Mat out = image.getMat();
+  render(out);
+  return true;
+}
+
+bool SyntheticCapture::read(OutputArray image)
+{
+  if (!grab())
+  {
+    image.release();
+    return false;
+  }
+  return retrieve(image);
+}
+
+void SyntheticCapture::render(Mat &out) const
+{
+  if (pattern == "noise")
+  {
+    // Worst case for the JPEG encoder: nothing compresses.
+    randu(out, Scalar::all(0), Scalar::all(255));
+  }
+  else if (motion == "pan")
+  {
+    int offset = (int)((frameIndex * 4) % width);
+    background(Rect(offset, 0, width - offset, height)).copyTo(out(Rect(0, 0, width - offset, height)));
+    if (offset > 0)
+    {
+      background(Rect(0, 0, offset, height)).copyTo(out(Rect(width - offset, 0, offset, height)));
+    }
+  }
+  else
+  {
+    background.copyTo(out);
+  }
+
+  if (motion == "box")
+  {
+    int box = max(8, height / 6);
+    int travel = max(1, width - box);
+    int position = (int)((frameIndex * 8) % (2 * travel));
+    int x = position < travel ? position : 2 * travel - position;
+    rectangle(out, Rect(x, (height - box) / 2, box, box), Scalar(255, 255, 255), FILLED);
+  }
+
+  auto now = system_clock::now();
+  time_t seconds = system_clock::to_time_t(now);
+  int millis = (int)(duration_cast<milliseconds>(now.time_since_epoch()).count() % 1000);
+  tm local;
+  localtime_r(&seconds, &local);
+
+  char label[64];
+  snprintf(label, sizeof(label), "#%lld %02d:%02d:%02d.%03d", frameIndex, local.tm_hour, local.tm_min, local.tm_sec, millis);
+
+  double scale = max(0.5, height / 720.0);
+  int baseline = 0;
+  Size textSize = getTextSize(label, FONT_HERSHEY_SIMPLEX, scale, 2, &baseline);
+  rectangle(out, Rect(0, height - textSize.height - baseline - 16, textSize.width + 16, textSize.height + baseline + 16),
+            Scalar(0, 0, 0), FILLED);
+  putText(out, label, Point(8, height - baseline - 8), FONT_HERSHEY_SIMPLEX, scale, Scalar(255, 255, 255), 2);
+}
+
+double SyntheticCapture::get(int propId) const
+{
+  switch (propId)
+  {
+  case CAP_PROP_FRAME_WIDTH:
+    return width;
+  case CAP_PROP_FRAME_HEIGHT:
+    return height;
+  case CAP_PROP_FPS:
+    return fps;
+  case CAP_PROP_POS_FRAMES:
+    return (double)frameIndex;
+  }
+  return 0;
+}
+
+LoopingFileCapture::LoopingFileCapture(const string &path) : VideoCapture(path) {}
+
+bool LoopingFileCapture::read(OutputArray image)
+{
+  if (VideoCapture::read(image))
+  {
+    return true;
+  }
+  set(CAP_PROP_POS_FRAMES, 0);
+  return VideoCapture::read(image);
+}
+
+unique_ptr<VideoCapture> openVirtualSource(const string &url)
+{
+  if (url.rfind("synthetic://", 0) == 0)
+  {
+    return make_unique<SyntheticCapture>(url);
+  }
+  if (url.rfind("file://", 0) == 0)
+  {
+    return make_unique<LoopingFileCapture>(url.substr(strlen("file://")));
+  }
+  return nullptr;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+// Splits "scheme://rest?key=value&..." query parameters into a map.
+std::map<std::string, std::string> parseQueryParams(const std::string &url);
+
+// Generated frames for exercising the pipeline without a camera:
+//   synthetic://?width=1280&height=720&fps=25&pattern=bars&motion=box
+// pattern is bars, gradient or noise; motion is box, pan or none. Every frame
+// carries its frame counter and wall-clock timestamp burned into the image.
+// Reads never block: the frame returned is the one due at the current time
+// at the source's fps, so the capture schedule alone sets the delivered rate.
+class SyntheticCapture : public cv::VideoCapture
+{
+private:
+  int width;
+  int height;
+  double fps;
+  std::string pattern;
+  std::string motion;
+  cv::Mat background;
+  std::chrono::steady_clock::time_point startedAt;
+  long long frameIndex = -1;
+  bool opened = false;
+
+  void render(cv::Mat &out) const;
+
+public:
+  explicit SyntheticCapture(const std::string &url);
+
+  bool isOpened() const override { return opened; }
+  void release() override { opened = false; }
+  bool grab() override;
+  bool retrieve(cv::OutputArray image, int flag = 0) override;
+  bool read(cv::OutputArray image) override;
+  double get(int propId) const override;
+};
+
+// file:///path/to/clip.mp4 — decodes a local file and rewinds at the end,
+// giving an endless real-footage source for benchmarks.
+class LoopingFileCapture : public cv::VideoCapture
+{
+public:
+  explicit LoopingFileCapture(const std::string &path);
+
+  bool read(cv::OutputArray image) override;
+};
+
+// Returns a capture for synthetic:// and file:// URLs, or null for anything
+// that should go to OpenCV directly.
+std::unique_ptr<cv::VideoCapture> openVirtualSource(const std::string &url);
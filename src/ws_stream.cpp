@@ -0,0 +1,346 @@
+#include "ws_stream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "include/crow_all.h"
+#include "trace.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+  constexpr size_t headerSize = 32;
+  constexpr uint8_t headerVersion = 1;
+  constexpr uint8_t codecJpeg = 1;
+  constexpr size_t defaultWindow = 2;
+  constexpr size_t maxWindow = 16;
+
+  void putBigEndian(char *out, uint64_t value, size_t bytes)
+  {
+    for (size_t i = 0; i < bytes; i++)
+    {
+      out[i] = (char)(value >> (8 * (bytes - 1 - i)));
+    }
+  }
+
+  string frameMessage(int cameraId, const EncodedFrame &frame, uint32_t skipped)
+  {
+    // Crow takes each message as its own string, so this one copy of the
+    // JPEG per client is the least the send can cost.
+    string message(headerSize + frame.jpeg.size(), '\0');
+    char *header = &message[0];
+    header[0] = (char)headerVersion;
+    header[1] = (char)codecJpeg;
+    putBigEndian(header + 2, headerSize, 2);
+    putBigEndian(header + 4, (uint32_t)cameraId, 4);
+    putBigEndian(header + 8, frame.info.seq, 8);
+    putBigEndian(header + 16, (uint64_t)frame.info.captureTimeUs, 8);
+    putBigEndian(header + 24, skipped, 4);
+    memcpy(header + headerSize, frame.jpeg.data(), frame.jpeg.size());
+    return message;
+  }
+}
+
+struct WebSocketStreamHub::Feed
+{
+  shared_ptr<const EncodedFrame> frame;
+  int watchers = 0;
+};
+
+struct WebSocketStreamHub::Client
+{
+  // One watched camera; keeps it encoding and counts as a viewer.
+  struct Subscription
+  {
+    shared_ptr<CameraConfig> camera;
+    JpegSubscription jpeg;
+    FrameRateLimiter limiter;
+    uint64_t lastSentSeq = 0;
+    uint64_t lastSentPublishedSeq = 0;
+    // Sent and not yet acknowledged, oldest first.
+    deque<uint64_t> unacked;
+
+    Subscription(JpegEncoderPool &encoder, shared_ptr<CameraConfig> camera, int fps)
+        : camera(camera), jpeg(encoder, camera), limiter(fps < camera->frameRate ? fps : 0)
+    {
+      this->camera->metrics.viewers++;
+    }
+    ~Subscription() { camera->metrics.viewers--; }
+  };
+
+  map<int, unique_ptr<Subscription>> cameras;
+  size_t window = defaultWindow;
+  int fps = 0;
+};
+
+WebSocketStreamHub::WebSocketStreamHub(function<shared_ptr<CameraConfig>(int)> getCamera, JpegEncoderPool &encoder)
+    : getCamera(move(getCamera)), encoder(encoder)
+{
+  sender = thread(&WebSocketStreamHub::senderLoop, this);
+}
+
+WebSocketStreamHub::~WebSocketStreamHub()
+{
+  {
+    lock_guard<mutex> lock(framesMutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  sender.join();
+}
+
+void WebSocketStreamHub::frameEncoded(CameraConfig &camera, const shared_ptr<const EncodedFrame> &frame)
+{
+  {
+    lock_guard<mutex> lock(framesMutex);
+    auto it = feeds.find(camera.id);
+    if (it == feeds.end())
+      return;
+    it->second->frame = frame;
+    changedCameras.insert(camera.id);
+  }
+  wake.notify_one();
+}
+
+void WebSocketStreamHub::watch(int cameraId, int delta)
+{
+  lock_guard<mutex> lock(framesMutex);
+  auto &feed = feeds[cameraId];
+  if (!feed)
+    feed = make_shared<Feed>();
+  feed->watchers += delta;
+  if (feed->watchers <= 0)
+    feeds.erase(cameraId);
+}
+
+void WebSocketStreamHub::addClient(crow::websocket::connection *client)
+{
+  lock_guard<mutex> lock(clientsMutex);
+  clients[client] = make_unique<Client>();
+}
+
+void WebSocketStreamHub::removeClient(crow::websocket::connection *client)
+{
+  // Once this returns the sender can no longer reach the connection, so
+  // Crow is free to delete it.
+  unique_ptr<Client> removed;
+  {
+    lock_guard<mutex> lock(clientsMutex);
+    auto it = clients.find(client);
+    if (it == clients.end())
+      return;
+    removed = move(it->second);
+    clients.erase(it);
+  }
+  for (auto &[id, subscription] : removed->cameras)
+  {
+    watch(id, -1);
+  }
+}
+
+bool WebSocketStreamHub::handleMessage(crow::websocket::connection *client, const string &message, string &error)
+{
+  auto json = crow::json::load(message);
+  if (!json || json.t() != crow::json::type::Object)
+  {
+    error = "expected a JSON object";
+    return false;
+  }
+
+  if (json.has("ack"))
+  {
+    if (json["ack"].t() != crow::json::type::Number || !json.has("seq") ||
+        json["seq"].t() != crow::json::type::Number)
+    {
+      error = "ack needs a camera id and a seq";
+      return false;
+    }
+    int cameraId = json["ack"].i();
+    uint64_t seq = json["seq"].u();
+    bool windowOpened = false;
+    {
+      lock_guard<mutex> lock(clientsMutex);
+      auto it = clients.find(client);
+      if (it == clients.end())
+        return true;
+      auto subscription = it->second->cameras.find(cameraId);
+      if (subscription == it->second->cameras.end())
+        return true;
+      auto &unacked = subscription->second->unacked;
+      windowOpened = unacked.size() >= it->second->window;
+      while (!unacked.empty() && unacked.front() <= seq)
+      {
+        unacked.pop_front();
+      }
+      windowOpened = windowOpened && unacked.size() < it->second->window;
+    }
+    if (windowOpened)
+    {
+      // The newest frame may have been held back while the window was full.
+      {
+        lock_guard<mutex> lock(framesMutex);
+        changedClients.insert(client);
+      }
+      wake.notify_one();
+    }
+    return true;
+  }
+
+  if (!json.has("subscribe") || json["subscribe"].t() != crow::json::type::List)
+  {
+    error = "expected {\"subscribe\": [ids]} or {\"ack\": id, \"seq\": n}";
+    return false;
+  }
+  vector<pair<int, shared_ptr<CameraConfig>>> wanted;
+  for (auto &id : json["subscribe"])
+  {
+    if (id.t() != crow::json::type::Number)
+    {
+      error = "camera ids must be numbers";
+      return false;
+    }
+    auto camera = getCamera(id.i());
+    if (!camera)
+    {
+      error = "camera " + to_string(id.i()) + " not found";
+      return false;
+    }
+    wanted.emplace_back(id.i(), move(camera));
+  }
+  size_t window = defaultWindow;
+  if (json.has("window") && json["window"].t() == crow::json::type::Number)
+    window = clamp<int64_t>(json["window"].i(), 1, maxWindow);
+  int fps = 0;
+  if (json.has("fps") && json["fps"].t() == crow::json::type::Number)
+    fps = (int)clamp<int64_t>(json["fps"].i(), 1, 60);
+
+  map<int, unique_ptr<Client::Subscription>> dropped;
+  vector<int> added;
+  {
+    lock_guard<mutex> lock(clientsMutex);
+    auto it = clients.find(client);
+    if (it == clients.end())
+      return true;
+    Client &state = *it->second;
+    state.window = window;
+    bool fpsChanged = state.fps != fps;
+    state.fps = fps;
+    map<int, unique_ptr<Client::Subscription>> cameras;
+    for (auto &[id, camera] : wanted)
+    {
+      if (cameras.count(id))
+        continue;
+      auto existing = state.cameras.find(id);
+      if (existing != state.cameras.end())
+      {
+        // Kept cameras carry on without a fresh keyframe or reset window.
+        cameras[id] = move(existing->second);
+        state.cameras.erase(existing);
+        if (fpsChanged)
+          cameras[id]->limiter = FrameRateLimiter(fps < camera->frameRate ? fps : 0);
+        continue;
+      }
+      // Watch before subscribing so the frame the subscription requests
+      // isn't missed.
+      watch(id, 1);
+      cameras[id] = make_unique<Client::Subscription>(encoder, camera, fps);
+      added.push_back(id);
+    }
+    dropped = move(state.cameras);
+    state.cameras = move(cameras);
+  }
+  for (auto &[id, subscription] : dropped)
+  {
+    watch(id, -1);
+  }
+  if (!added.empty())
+  {
+    {
+      lock_guard<mutex> lock(framesMutex);
+      changedClients.insert(client);
+    }
+    wake.notify_one();
+  }
+  return true;
+}
+
+size_t WebSocketStreamHub::getClientCount()
+{
+  lock_guard<mutex> lock(clientsMutex);
+  return clients.size();
+}
+
+void WebSocketStreamHub::senderLoop()
+{
+  setTraceThreadName("ws-stream");
+
+  unique_lock<mutex> framesLock(framesMutex);
+  while (true)
+  {
+    wake.wait(framesLock, [&]
+              { return stopping || !changedCameras.empty() || !changedClients.empty(); });
+    if (stopping)
+      break;
+
+    set<int> cameras;
+    set<crow::websocket::connection *> changed;
+    cameras.swap(changedCameras);
+    changed.swap(changedClients);
+    map<int, shared_ptr<const EncodedFrame>> frames;
+    for (auto &[id, feed] : feeds)
+    {
+      if (feed->frame)
+        frames[id] = feed->frame;
+    }
+    framesLock.unlock();
+
+    {
+      TraceSpan span("ws-send");
+      lock_guard<mutex> lock(clientsMutex);
+      for (auto &[connection, client] : clients)
+      {
+        bool clientChanged = changed.count(connection) > 0;
+        for (auto &[id, subscription] : client->cameras)
+        {
+          if (!clientChanged && !cameras.count(id))
+            continue;
+          auto frame = frames.find(id);
+          if (frame == frames.end())
+            continue;
+          const EncodedFrame &encoded = *frame->second;
+          uint64_t seq = encoded.info.seq;
+          if (seq < subscription->jpeg.minSeq() || seq <= subscription->lastSentSeq ||
+              subscription->unacked.size() >= client->window ||
+              !subscription->limiter.due(encoded.info.captureTimeUs))
+            continue;
+
+          // Counted in encoded frames; capture seq gaps would include frames
+          // the encoder never saw.
+          uint32_t skipped = 0;
+          uint64_t publishedSeq = encoded.publishedSeq;
+          if (subscription->lastSentPublishedSeq > 0 && publishedSeq > subscription->lastSentPublishedSeq + 1)
+          {
+            skipped = (uint32_t)min<uint64_t>(publishedSeq - subscription->lastSentPublishedSeq - 1, UINT32_MAX);
+            // Frames thinned out for the requested rate aren't drops.
+            if (!subscription->limiter.limited())
+              subscription->camera->metrics.sendDropped.add(skipped);
+          }
+          string message = frameMessage(id, encoded, skipped);
+          CameraConfig &camera = *subscription->camera;
+          camera.metrics.bytesSent.add(message.size());
+          camera.metrics.framesSent.add();
+          connection->send_binary(move(message));
+          camera.latency.captureToSend.record(steady_clock::now() - encoded.info.capturedAt);
+          subscription->lastSentSeq = seq;
+          subscription->lastSentPublishedSeq = publishedSeq;
+          subscription->limiter.sent(encoded.info.captureTimeUs);
+          subscription->unacked.push_back(seq);
+        }
+      }
+    }
+
+    framesLock.lock();
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include "encoder.h"
+
+namespace crow
+{
+  namespace websocket
+  {
+    struct connection;
+  }
+}
+
+// Live video over a WebSocket, as an alternative to one multipart MJPEG
+// connection per camera. A client subscribes to any number of cameras and
+// receives each shared encoded frame as one binary message:
+//
+//   offset  size  field (big-endian)
+//   0       1     header version, 1
+//   1       1     codec, 1 = JPEG
+//   2       2     header size in bytes; the payload follows it
+//   4       4     camera id
+//   8       8     frame sequence number
+//   16      8     capture time, microseconds since the Unix epoch
+//   24      4     encoded frames of this camera skipped since the last one
+//   28      4     reserved
+//
+// Text messages from the client: {"subscribe": [1, 2], "window": 2, "fps": 5}
+// replaces the subscription, and {"ack": 1, "seq": 123} reports every frame
+// of camera 1 up to seq as displayed. The optional fps thins every camera to
+// at most that rate by skipping shared frames, never by encoding more. At
+// most `window` unacknowledged frames per camera are in flight; while the
+// client is behind, the server skips to the newest frame instead of
+// queueing, and says how many it skipped.
+//
+// Encoder threads only record each watched camera's newest frame; a sender
+// thread does the fan-out, so a slow client never holds up encoding.
+class WebSocketStreamHub : public EncodedFrameListener
+{
+private:
+  struct Feed;
+  struct Client;
+
+  std::function<std::shared_ptr<CameraConfig>(int)> getCamera;
+  JpegEncoderPool &encoder;
+
+  std::mutex framesMutex;
+  std::condition_variable wake;
+  // Newest frame of every camera someone watches, and those not yet fanned out.
+  std::map<int, std::shared_ptr<Feed>> feeds;
+  std::set<int> changedCameras;
+  std::set<crow::websocket::connection *> changedClients;
+  bool stopping = false;
+
+  std::mutex clientsMutex;
+  std::map<crow::websocket::connection *, std::unique_ptr<Client>> clients;
+
+  std::thread sender;
+
+  void senderLoop();
+  void watch(int cameraId, int delta);
+
+public:
+  WebSocketStreamHub(std::function<std::shared_ptr<CameraConfig>(int)> getCamera, JpegEncoderPool &encoder);
+  ~WebSocketStreamHub();
+
+  void frameEncoded(CameraConfig &camera, const std::shared_ptr<const EncodedFrame> &frame) override;
+
+  void addClient(crow::websocket::connection *client);
+  void removeClient(crow::websocket::connection *client);
+  // Applies a subscribe or ack message; false with `error` set if invalid.
+  bool handleMessage(crow::websocket::connection *client, const std::string &message, std::string &error);
+  size_t getClientCount();
+};
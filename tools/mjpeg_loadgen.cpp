@@ -0,0 +1,430 @@
+// MJPEG load generator: opens many concurrent viewer connections to the stream
+// server, parses the multipart/x-mixed-replace responses and reports per-client
+// and aggregate frame rate, throughput, inter-frame jitter and delivery latency.
+// When the server stamps parts with X-Timestamp / X-Frame-Seq, frame age
+// (capture to receipt, so run it on a host with a synchronized clock) and
+// skipped frames are reported as well.
+//
+//   mjpeg_loadgen --clients 200 --paths /1,/2,/3 --duration 30 --json report.json
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+using namespace boost::asio;
+
+struct Options
+{
+  string host = "127.0.0.1";
+  string port = "3000";
+  vector<string> paths = {"/1"};
+  int clients = 10;
+  int durationSeconds = 10;
+  int rampMs = 0;
+  int threads = 1;
+  string jsonPath;
+};
+
+struct ClientStats
+{
+  string path;
+  bool connected = false;
+  string error;
+  size_t frames = 0;
+  size_t bytes = 0;
+  double firstFrameMs = -1;
+  vector<double> gapsMs;
+  vector<double> agesMs;
+  uint64_t lastSeq = 0;
+  size_t skippedFrames = 0;
+};
+
+double percentile(vector<double> values, double p)
+{
+  if (values.empty())
+    return 0;
+  sort(values.begin(), values.end());
+  size_t rank = (size_t)ceil(p / 100.0 * values.size());
+  return values[rank == 0 ? 0 : min(rank, values.size()) - 1];
+}
+
+double stddev(const vector<double> &values)
+{
+  if (values.size() < 2)
+    return 0;
+  double mean = accumulate(values.begin(), values.end(), 0.0) / values.size();
+  double sq = 0;
+  for (double v : values)
+    sq += (v - mean) * (v - mean);
+  return sqrt(sq / (values.size() - 1));
+}
+
+string headerValue(const string &headers, const string &name)
+{
+  string lower = headers;
+  transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  string key = name + ":";
+  transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+  size_t pos = lower.find(key);
+  if (pos == string::npos)
+    return "";
+  pos += key.size();
+  size_t end = headers.find("\r\n", pos);
+  string value = headers.substr(pos, end == string::npos ? string::npos : end - pos);
+  value.erase(0, value.find_first_not_of(" \t"));
+  value.erase(value.find_last_not_of(" \t") + 1);
+  return value;
+}
+
+// One viewer connection. Every operation is chained from the previous one,
+// and the socket lives on its own strand, so handlers never run concurrently
+// even when the io_context is driven by several threads.
+class Client : public enable_shared_from_this<Client>
+{
+private:
+  ip::tcp::socket socket;
+  const ip::tcp::resolver::results_type &endpoints;
+  const Options &options;
+  boost::asio::streambuf input;
+  steady_clock::time_point connectedAt;
+  steady_clock::time_point lastFrameAt;
+
+public:
+  ClientStats stats;
+
+  Client(io_context &io, const ip::tcp::resolver::results_type &endpoints, const Options &options, string path)
+      : socket(make_strand(io)), endpoints(endpoints), options(options)
+  {
+    stats.path = move(path);
+  }
+
+  void start()
+  {
+    auto self = shared_from_this();
+    async_connect(socket, endpoints, [self](boost::system::error_code ec, const ip::tcp::endpoint &)
+                  {
+      if (ec)
+        return self->fail("connect", ec);
+      self->connectedAt = steady_clock::now();
+      self->sendRequest(); });
+  }
+
+  void stop()
+  {
+    auto self = shared_from_this();
+    post(socket.get_executor(), [self]
+         {
+      boost::system::error_code ignored;
+      self->socket.close(ignored); });
+  }
+
+private:
+  void fail(const char *stage, boost::system::error_code ec)
+  {
+    if (ec != error::operation_aborted && stats.error.empty())
+    {
+      stats.error = string(stage) + ": " + ec.message();
+    }
+  }
+
+  void sendRequest()
+  {
+    auto request = make_shared<string>("GET " + stats.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n\r\n");
+    auto self = shared_from_this();
+    async_write(socket, buffer(*request), [self, request](boost::system::error_code ec, size_t)
+                {
+      if (ec)
+        return self->fail("write", ec);
+      self->readResponseHeader(); });
+  }
+
+  void readResponseHeader()
+  {
+    auto self = shared_from_this();
+    async_read_until(socket, input, "\r\n\r\n", [self](boost::system::error_code ec, size_t length)
+                     {
+      if (ec)
+        return self->fail("response", ec);
+
+      string header(buffers_begin(self->input.data()), buffers_begin(self->input.data()) + length);
+      self->input.consume(length);
+      if (header.compare(0, 12, "HTTP/1.1 200") != 0 && header.compare(0, 12, "HTTP/1.0 200") != 0)
+      {
+        self->stats.error = "response: " + header.substr(0, header.find("\r\n"));
+        return;
+      }
+      self->stats.connected = true;
+      self->readPartHeader(); });
+  }
+
+  // Part headers are located by their terminating blank line, so stray bytes
+  // between a part's body and the next boundary are tolerated.
+  void readPartHeader()
+  {
+    auto self = shared_from_this();
+    async_read_until(socket, input, "\r\n\r\n", [self](boost::system::error_code ec, size_t length)
+                     {
+      if (ec)
+        return self->fail("part", ec);
+
+      string headers(buffers_begin(self->input.data()), buffers_begin(self->input.data()) + length);
+      self->input.consume(length);
+      self->stats.bytes += length;
+
+      string contentLength = headerValue(headers, "Content-Length");
+      if (contentLength.empty())
+      {
+        self->stats.error = "part: missing Content-Length";
+        return;
+      }
+      self->trackFrameHeaders(headers);
+      self->readPartBody(stoul(contentLength)); });
+  }
+
+  void trackFrameHeaders(const string &headers)
+  {
+    string timestamp = headerValue(headers, "X-Timestamp");
+    if (!timestamp.empty())
+    {
+      double now = duration<double>(system_clock::now().time_since_epoch()).count();
+      stats.agesMs.push_back((now - stod(timestamp)) * 1000.0);
+    }
+
+    string seq = headerValue(headers, "X-Frame-Seq");
+    if (!seq.empty())
+    {
+      uint64_t current = stoull(seq);
+      if (stats.lastSeq != 0 && current > stats.lastSeq + 1)
+      {
+        stats.skippedFrames += current - stats.lastSeq - 1;
+      }
+      stats.lastSeq = current;
+    }
+  }
+
+  void readPartBody(size_t length)
+  {
+    size_t buffered = input.size();
+    if (buffered >= length)
+    {
+      input.consume(length);
+      onFrame(length);
+      return;
+    }
+
+    auto self = shared_from_this();
+    async_read(socket, input, transfer_exactly(length - buffered), [self, length](boost::system::error_code ec, size_t)
+               {
+      if (ec)
+        return self->fail("body", ec);
+      self->input.consume(length);
+      self->onFrame(length); });
+  }
+
+  void onFrame(size_t length)
+  {
+    auto now = steady_clock::now();
+    if (stats.frames == 0)
+    {
+      stats.firstFrameMs = duration<double, milli>(now - connectedAt).count();
+    }
+    else
+    {
+      stats.gapsMs.push_back(duration<double, milli>(now - lastFrameAt).count());
+    }
+    lastFrameAt = now;
+    stats.frames++;
+    stats.bytes += length;
+
+    // Bound the recursion depth when many parts are already buffered.
+    auto self = shared_from_this();
+    post(socket.get_executor(), [self]
+         { self->readPartHeader(); });
+  }
+};
+
+void usage()
+{
+  cerr << "usage: mjpeg_loadgen [--host H] [--port P] [--paths /1,/2] [--clients N]\n"
+          "                     [--duration S] [--ramp-ms MS] [--threads T] [--json FILE]\n";
+}
+
+bool parseOptions(int argc, char **argv, Options &options)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    if (i + 1 >= argc)
+      return false;
+    string value = argv[++i];
+
+    if (arg == "--host")
+      options.host = value;
+    else if (arg == "--port")
+      options.port = value;
+    else if (arg == "--clients")
+      options.clients = stoi(value);
+    else if (arg == "--duration")
+      options.durationSeconds = stoi(value);
+    else if (arg == "--ramp-ms")
+      options.rampMs = stoi(value);
+    else if (arg == "--threads")
+      options.threads = max(1, stoi(value));
+    else if (arg == "--json")
+      options.jsonPath = value;
+    else if (arg == "--paths")
+    {
+      options.paths.clear();
+      stringstream list(value);
+      string path;
+      while (getline(list, path, ','))
+        options.paths.push_back(path);
+    }
+    else
+      return false;
+  }
+  return !options.paths.empty() && options.clients > 0 && options.durationSeconds > 0;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  try
+  {
+    if (!parseOptions(argc, argv, options))
+    {
+      usage();
+      return 2;
+    }
+  }
+  catch (exception &)
+  {
+    usage();
+    return 2;
+  }
+
+  io_context io;
+  auto work = make_work_guard(io);
+  ip::tcp::resolver resolver(io);
+  auto endpoints = resolver.resolve(options.host, options.port);
+
+  vector<shared_ptr<Client>> clients;
+  for (int i = 0; i < options.clients; i++)
+  {
+    clients.push_back(make_shared<Client>(io, endpoints, options, options.paths[i % options.paths.size()]));
+  }
+
+  vector<thread> threads;
+  for (int i = 0; i < options.threads; i++)
+  {
+    threads.emplace_back([&]
+                         { io.run(); });
+  }
+
+  auto started = steady_clock::now();
+  for (auto &client : clients)
+  {
+    client->start();
+    if (options.rampMs > 0)
+      this_thread::sleep_for(milliseconds(options.rampMs));
+  }
+
+  this_thread::sleep_until(started + seconds(options.durationSeconds));
+  double elapsed = duration<double>(steady_clock::now() - started).count();
+
+  for (auto &client : clients)
+    client->stop();
+  work.reset();
+  for (auto &t : threads)
+    t.join();
+
+  // Aggregate. Rates use the full run time so late connections and stalls
+  // show up as lower fps instead of being averaged away.
+  size_t connected = 0, totalFrames = 0, totalBytes = 0, skipped = 0;
+  vector<double> allGaps, allAges, firstFrames, clientFps, jitters;
+  for (auto &client : clients)
+  {
+    auto &s = client->stats;
+    connected += s.connected;
+    totalFrames += s.frames;
+    totalBytes += s.bytes;
+    allGaps.insert(allGaps.end(), s.gapsMs.begin(), s.gapsMs.end());
+    allAges.insert(allAges.end(), s.agesMs.begin(), s.agesMs.end());
+    skipped += s.skippedFrames;
+    if (s.firstFrameMs >= 0)
+      firstFrames.push_back(s.firstFrameMs);
+    clientFps.push_back(s.frames / elapsed);
+    jitters.push_back(stddev(s.gapsMs));
+  }
+
+  cout << fixed << setprecision(2);
+  cout << "clients:            " << connected << "/" << options.clients << " connected\n"
+       << "duration:           " << elapsed << " s\n"
+       << "frames:             " << totalFrames << " (" << totalFrames / elapsed << " fps total)\n"
+       << "throughput:         " << totalBytes / elapsed / 1e6 * 8 << " Mbit/s\n"
+       << "per-client fps:     min " << percentile(clientFps, 0) << " p50 " << percentile(clientFps, 50) << " max "
+       << percentile(clientFps, 100) << "\n"
+       << "inter-frame gap ms: p50 " << percentile(allGaps, 50) << " p99 " << percentile(allGaps, 99) << "\n"
+       << "jitter ms (stddev): p50 " << percentile(jitters, 50) << " p99 " << percentile(jitters, 99) << "\n"
+       << "first frame ms:     p50 " << percentile(firstFrames, 50) << " p99 " << percentile(firstFrames, 99) << "\n";
+  if (!allAges.empty())
+  {
+    cout << "frame age ms:       p50 " << percentile(allAges, 50) << " p99 " << percentile(allAges, 99) << "\n"
+         << "skipped frames:     " << skipped << "\n";
+  }
+
+  size_t errors = 0;
+  for (auto &client : clients)
+  {
+    if (!client->stats.error.empty() && errors++ < 5)
+      cerr << client->stats.path << ": " << client->stats.error << "\n";
+  }
+
+  if (!options.jsonPath.empty())
+  {
+    ofstream json(options.jsonPath);
+    json << fixed << setprecision(3);
+    json << "{\n"
+         << "  \"clients\": " << options.clients << ",\n"
+         << "  \"connected\": " << connected << ",\n"
+         << "  \"errors\": " << errors << ",\n"
+         << "  \"durationSeconds\": " << elapsed << ",\n"
+         << "  \"frames\": " << totalFrames << ",\n"
+         << "  \"fps\": " << totalFrames / elapsed << ",\n"
+         << "  \"bytesPerSecond\": " << totalBytes / elapsed << ",\n"
+         << "  \"clientFps\": {\"min\": " << percentile(clientFps, 0) << ", \"p50\": " << percentile(clientFps, 50)
+         << ", \"max\": " << percentile(clientFps, 100) << "},\n"
+         << "  \"interFrameMs\": {\"p50\": " << percentile(allGaps, 50) << ", \"p99\": " << percentile(allGaps, 99) << "},\n"
+         << "  \"jitterMs\": {\"p50\": " << percentile(jitters, 50) << ", \"p99\": " << percentile(jitters, 99) << "},\n"
+         << "  \"firstFrameMs\": {\"p50\": " << percentile(firstFrames, 50) << ", \"p99\": " << percentile(firstFrames, 99) << "},\n"
+         << "  \"frameAgeMs\": {\"p50\": " << percentile(allAges, 50) << ", \"p99\": " << percentile(allAges, 99) << "},\n"
+         << "  \"skippedFrames\": " << skipped << ",\n"
+         << "  \"perClient\": [\n";
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+      auto &s = clients[i]->stats;
+      json << "    {\"path\": \"" << s.path << "\", \"frames\": " << s.frames << ", \"fps\": " << s.frames / elapsed
+           << ", \"bytesPerSecond\": " << s.bytes / elapsed << ", \"jitterMs\": " << stddev(s.gapsMs)
+           << ", \"gapP99Ms\": " << percentile(s.gapsMs, 99) << ", \"ageP99Ms\": " << percentile(s.agesMs, 99)
+           << ", \"firstFrameMs\": " << s.firstFrameMs << "}"
+           << (i + 1 < clients.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+  }
+
+  return connected == (size_t)options.clients ? 0 : 1;
+}